@@ -0,0 +1,70 @@
+#!/bin/bash
+# Load-test matrix for server_linux: every engine, keep-alive on and off,
+# one and many connections, over the same generated file set.
+# Results are appended to bench_results.csv, tagged with the commit, so
+# the file accumulates a history. If BASELINE names an earlier commit in
+# that file, rows that lost more than 10% throughput or gained more than
+# 25% p99 compared with it are flagged.
+#
+#   ./bench_matrix.sh                 # full matrix
+#   DURATION=3 ./bench_matrix.sh      # shorter runs
+#   BASELINE=abc1234 ./bench_matrix.sh
+
+PORT=${PORT:-8099}
+DURATION=${DURATION:-5}
+ENGINES=${ENGINES:-"serial epoll uring"}
+CONNECTIONS=${CONNECTIONS:-"1 50"}
+SIZE_DIST=${SIZE_DIST:-"1k:60,16k:30,256k:9,4m:1"}
+RESULTS=${RESULTS:-bench_results.csv}
+WWW=$(mktemp -d)
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+echo "[+] Building..."
+make -s server_linux loadgen || exit 1
+
+echo "[+] Generating file set in $WWW ($SIZE_DIST)"
+cp -r static/. "$WWW"
+./loadgen --populate "$WWW" --size-dist "$SIZE_DIST" > /dev/null || exit 1
+
+if [ ! -f "$RESULTS" ]; then
+    echo "commit,engine,connections,keepalive,requests,errors,rps,mbps,p50_us,p99_us,p999_us,max_us" > "$RESULTS"
+fi
+
+for engine in $ENGINES; do
+    ./server_linux $PORT "$WWW" --engine $engine --log-file /dev/null > "$WWW/server_$engine.out" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+    for connections in $CONNECTIONS; do
+        for keepalive in keepalive no-keepalive; do
+            echo "[+] $engine, $connections connections, $keepalive"
+            row=$(./loadgen --port $PORT --connections $connections --duration $DURATION --$keepalive \
+                            --size-dist "$SIZE_DIST" --csv "$engine")
+            echo "$COMMIT,$row" >> "$RESULTS"
+        done
+    done
+    if ! kill $SERVER_PID 2>/dev/null; then
+        echo "[!] $engine server exited during the run:"
+        cat "$WWW/server_$engine.out"
+    fi
+    wait $SERVER_PID 2>/dev/null
+done
+rm -rf "$WWW"
+
+echo ""
+echo "==== RESULTS ($COMMIT) ===="
+(head -1 "$RESULTS"; grep "^$COMMIT," "$RESULTS") | tr ',' '\t'
+
+if [ -n "$BASELINE" ]; then
+    echo ""
+    echo "==== COMPARED WITH $BASELINE ===="
+    awk -F, -v base="$BASELINE" -v head="$COMMIT" '
+        $1 == base { key = $2 FS $3 FS $4; rps[key] = $7; p99[key] = $10 }
+        $1 == head {
+            key = $2 FS $3 FS $4
+            if (!(key in rps)) next
+            flag = ""
+            if ($7 < rps[key] * 0.9) flag = flag " THROUGHPUT"
+            if ($10 > p99[key] * 1.25) flag = flag " P99"
+            printf "%-8s %4s conns %-4s  rps %8s -> %8s  p99 %7s -> %7s us%s\n", $2, $3, $4, rps[key], $7, p99[key], $10, (flag == "" ? "" : "  REGRESSION:" flag)
+        }' "$RESULTS"
+fi
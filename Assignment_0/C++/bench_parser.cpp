@@ -0,0 +1,117 @@
+// Microbenchmark: HttpParser against the previous istringstream parsing.
+// The legacy path is what handle_request() used to do per request: copy the
+// buffer into a std::string, pull method/path/version out with
+// std::istringstream, and look headers up by scanning and substr()-ing.
+
+#include "http_parser.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define ITERATIONS 1000000
+
+// A typical browser request, as recorded in server.log
+const std::string sampleRequest =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: 127.0.0.1:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Brave\";v=\"131\", \"Chromium\";v=\"131\", \"Not_A Brand\";v=\"24\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Windows\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/131.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-GPC: 1\r\n"
+    "Accept-Language: en-US,en\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "\r\n";
+
+// Headers the server consults for every request
+const char* lookedUp[] = {"Connection", "Accept-Encoding", "Range", "If-None-Match", "If-Modified-Since"};
+
+bool legacy_iequals(const std::string& a, const std::string& b){
+    if(a.size() != b.size()) return false;
+    for(size_t i = 0; i < a.size(); i++){
+        if(tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+std::string legacy_get_header(const std::string& request, const std::string& name){
+    size_t lineStart = request.find("\r\n");
+    while(lineStart != std::string::npos){
+        lineStart += 2;
+        size_t lineEnd = request.find("\r\n", lineStart);
+        if(lineEnd == std::string::npos || lineEnd == lineStart) break;
+        size_t colon = request.find(':', lineStart);
+        if(colon != std::string::npos && colon < lineEnd && legacy_iequals(request.substr(lineStart, colon-lineStart), name)){
+            size_t valueStart = request.find_first_not_of(" \t", colon+1);
+            if(valueStart == std::string::npos || valueStart >= lineEnd) return "";
+            size_t valueEnd = request.find_last_not_of(" \t", lineEnd-1);
+            return request.substr(valueStart, valueEnd-valueStart+1);
+        }
+        lineStart = lineEnd;
+    }
+    return "";
+}
+
+size_t legacy_parse(const char* buffer){
+    std::string request(buffer);
+    std::istringstream requestStream(request);
+    std::string method, path, version;
+    requestStream >> method >> path >> version;
+    size_t checksum = method.size() + path.size() + version.size();
+    for(const char* name : lookedUp) checksum += legacy_get_header(request, name).size();
+    return checksum;
+}
+
+size_t parser_parse(const char* buffer, size_t length){
+    HttpParser parser(65536);
+    HttpRequest request;
+    if(parser.parse(buffer, length, request) != HTTP_PARSE_DONE) return 0;
+    size_t checksum = request.method.size() + request.target.size() + request.version.size();
+    for(const char* name : lookedUp) checksum += request.header(name).size();
+    return checksum;
+}
+
+// The same request delivered in 64-byte segments, parsed after each one
+size_t parser_parse_segmented(const char* buffer, size_t length){
+    HttpParser parser(65536);
+    HttpRequest request;
+    for(size_t available = 64; ; available += 64){
+        if(available > length) available = length;
+        HttpParseResult result = parser.parse(buffer, available, request);
+        if(result == HTTP_PARSE_DONE) break;
+        if(result == HTTP_PARSE_ERROR || available == length) return 0;
+    }
+    size_t checksum = request.method.size() + request.target.size() + request.version.size();
+    for(const char* name : lookedUp) checksum += request.header(name).size();
+    return checksum;
+}
+
+template <typename Fn>
+void run(const char* label, Fn fn){
+    size_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < ITERATIONS; i++) checksum += fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout<<label<<": "<<(elapsed.count() * 1e9 / ITERATIONS)<<" ns/request, "
+             <<(size_t)(ITERATIONS / elapsed.count())<<" requests/s (checksum "<<checksum<<")\n";
+}
+
+int main(){
+    const char* buffer = sampleRequest.c_str();
+    size_t length = sampleRequest.size();
+    std::cout<<"Request of "<<length<<" bytes, "<<ITERATIONS<<" iterations\n";
+    run("istringstream + get_header ", [&]{ return legacy_parse(buffer); });
+    run("HttpParser                 ", [&]{ return parser_parse(buffer, length); });
+    run("HttpParser, 64-byte pieces ", [&]{ return parser_parse_segmented(buffer, length); });
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Incremental HTTP/1.x request parser for the Linux static server.
+// Works directly over a connection's read buffer: every field of the parsed
+// request is a std::string_view into that buffer, so parsing allocates
+// nothing. The views stay valid until the buffer is next modified.
+
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <string_view>
+#include <cstddef>
+#include <cstring>
+
+#define MAX_HEADERS 32
+
+enum HttpParseResult {
+    HTTP_PARSE_ERROR = -1,       // malformed request line or header
+    HTTP_PARSE_INCOMPLETE = 0,   // need more bytes
+    HTTP_PARSE_DONE = 1
+};
+
+inline bool iequals(std::string_view a, std::string_view b){
+    if(a.size() != b.size()) return false;
+    for(size_t i = 0; i < a.size(); i++){
+        unsigned char x = a[i], y = b[i];
+        if(x == y) continue;
+        if((x | 0x20) != (y | 0x20) || (x | 0x20) < 'a' || (x | 0x20) > 'z') return false;
+    }
+    return true;
+}
+
+inline std::string_view trim(std::string_view value){
+    while(!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+    while(!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+    return value;
+}
+
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+struct HttpRequest {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::string_view requestLine;
+    HttpHeader headers[MAX_HEADERS];
+    int headerCount = 0;
+    size_t contentLength = 0;
+    size_t totalLength = 0;      // head plus body, i.e. bytes to consume
+
+    // Value of the first header called `name`, or an empty view.
+    std::string_view header(std::string_view name) const {
+        for(int i = 0; i < headerCount; i++){
+            if(iequals(headers[i].name, name)) return headers[i].value;
+        }
+        return std::string_view();
+    }
+
+    // HTTP/1.1 keeps the connection open unless told otherwise, HTTP/1.0 only on request.
+    bool keep_alive() const {
+        std::string_view connection = header("Connection");
+        if(version == "HTTP/1.1") return !iequals(connection, "close");
+        return iequals(connection, "keep-alive");
+    }
+};
+
+// Resumable parser. Feed it the same growing buffer after every read; it
+// remembers how far it has already looked for the end of the head, so a
+// request that trickles in over many TCP segments is scanned once in total.
+struct HttpParser {
+    size_t scanned = 0;
+    size_t maxRequestSize;
+
+    explicit HttpParser(size_t maxSize) : maxRequestSize(maxSize) {}
+
+    void reset(){
+        scanned = 0;
+    }
+
+    HttpParseResult parse(const char* data, size_t length, HttpRequest& request){
+        // Find the blank line that ends the head, resuming where the last call stopped
+        size_t from = scanned >= 3 ? scanned - 3 : 0;
+        const char* headEnd = nullptr;
+        for(const char* p = data + from; p + 3 < data + length; p++){
+            p = (const char*)memchr(p, '\r', data + length - 3 - p);
+            if(p == nullptr) break;
+            if(p[1] == '\n' && p[2] == '\r' && p[3] == '\n'){
+                headEnd = p;
+                break;
+            }
+        }
+        if(headEnd == nullptr){
+            scanned = length;
+            return length >= maxRequestSize ? HTTP_PARSE_ERROR : HTTP_PARSE_INCOMPLETE;
+        }
+        size_t headLength = headEnd - data + 4;
+
+        size_t lineEnd = (const char*)memchr(data, '\r', headLength) - data;
+        if(data[lineEnd + 1] != '\n') return HTTP_PARSE_ERROR;
+        request.requestLine = std::string_view(data, lineEnd);
+        if(!parse_request_line(request.requestLine, request)) return HTTP_PARSE_ERROR;
+
+        request.headerCount = 0;
+        request.contentLength = 0;
+        const char* cursor = data + lineEnd + 2;
+        const char* end = headEnd + 2;              // one past the last header's CRLF
+        while(cursor < end){
+            const char* lineStop = (const char*)memchr(cursor, '\r', end - cursor);
+            if(lineStop[1] != '\n') return HTTP_PARSE_ERROR;   // bare CR inside a header
+            if(*cursor == ' ' || *cursor == '\t') return HTTP_PARSE_ERROR;   // obsolete line folding
+            const char* colon = cursor;
+            while(colon < lineStop && *colon != ':'){
+                if(*colon == ' ' || *colon == '\t') return HTTP_PARSE_ERROR;
+                colon++;
+            }
+            if(colon == lineStop || colon == cursor) return HTTP_PARSE_ERROR;
+            if(request.headerCount == MAX_HEADERS) return HTTP_PARSE_ERROR;
+            HttpHeader& header = request.headers[request.headerCount++];
+            header.name = std::string_view(cursor, colon - cursor);
+            header.value = trim(std::string_view(colon + 1, lineStop - colon - 1));
+            cursor = lineStop + 2;
+            if(iequals(header.name, "Content-Length")){
+                if(!parse_length(header.value, request.contentLength)) return HTTP_PARSE_ERROR;
+            }
+            else if(iequals(header.name, "Transfer-Encoding")){
+                return HTTP_PARSE_ERROR;   // request bodies are never chunked for GET
+            }
+        }
+
+        if(request.contentLength > maxRequestSize) return HTTP_PARSE_ERROR;
+        request.totalLength = headLength + request.contentLength;
+        if(length < request.totalLength){
+            scanned = headEnd - data;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+        scanned = 0;
+        return HTTP_PARSE_DONE;
+    }
+
+private:
+    static bool parse_request_line(std::string_view line, HttpRequest& request){
+        size_t firstSpace = line.find(' ');
+        if(firstSpace == std::string_view::npos || firstSpace == 0) return false;
+        size_t secondSpace = line.find(' ', firstSpace + 1);
+        if(secondSpace == std::string_view::npos || secondSpace == firstSpace + 1) return false;
+        request.method = line.substr(0, firstSpace);
+        request.target = line.substr(firstSpace + 1, secondSpace - firstSpace - 1);
+        request.version = line.substr(secondSpace + 1);
+        return request.version.size() == 8 && request.version.substr(0, 7) == "HTTP/1.";
+    }
+
+    static bool parse_length(std::string_view text, size_t& value){
+        if(text.empty() || text.size() > 18) return false;
+        value = 0;
+        for(char c : text){
+            if(c < '0' || c > '9') return false;
+            value = value * 10 + (c - '0');
+        }
+        return true;
+    }
+};
+
+#endif
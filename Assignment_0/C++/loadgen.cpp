@@ -0,0 +1,423 @@
+// HTTP load generator for the Linux static server.
+// Keeps a fixed number of connections busy over loopback, one request in
+// flight on each, from a single epoll loop. Requests are drawn from a
+// weighted mix of paths; --size-dist builds that mix from files of given
+// sizes, which --populate writes into the served directory beforehand.
+// Latencies go into an HDR-style histogram (two significant digits) and
+// are reported as p50/p99/p99.9.
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+
+#define MAX_EVENTS 1024
+#define READ_CHUNK_SIZE 65536
+#define SUB_BUCKETS 256              // 2 significant digits
+#define BUCKET_SHIFTS 40
+
+// Log-linear latency histogram in microseconds. Values below SUB_BUCKETS
+// are exact; above that each power of two is split into 128 buckets, so
+// any recorded value is off by less than 1%.
+struct LatencyHistogram {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(SUB_BUCKETS + BUCKET_SHIFTS * (SUB_BUCKETS / 2), 0);
+    uint64_t total = 0;
+    uint64_t maxValue = 0;
+
+    static size_t index_of(uint64_t value){
+        if(value < SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - 7;   // value >> shift lands in [128, 256)
+        return SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) + ((value >> shift) - SUB_BUCKETS / 2);
+    }
+
+    // Highest value that falls in bucket `index`
+    static uint64_t value_at(size_t index){
+        if(index < SUB_BUCKETS) return index;
+        int shift = (index - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+        uint64_t sub = (index - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    void record(uint64_t value){
+        size_t index = std::min(index_of(value), counts.size() - 1);
+        counts[index]++;
+        total++;
+        maxValue = std::max(maxValue, value);
+    }
+
+    uint64_t percentile(double q) const {
+        if(total == 0) return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(q * total + 0.999999));
+        uint64_t seen = 0;
+        for(size_t i = 0; i < counts.size(); i++){
+            seen += counts[i];
+            if(seen >= target) return std::min(value_at(i), maxValue);
+        }
+        return maxValue;
+    }
+};
+
+struct MixEntry {
+    std::string path;
+    double weight;
+};
+
+enum ConnState {
+    STATE_CONNECTING,
+    STATE_SENDING,
+    STATE_READING
+};
+
+struct ClientConn {
+    int fd = -1;
+    ConnState state = STATE_CONNECTING;
+    std::string request;
+    size_t sent = 0;
+    std::string head;                // response head until it is complete
+    bool headDone = false;
+    size_t bodyLeft = 0;
+    int status = 0;
+    bool serverCloses = false;       // response carried "Connection: close"
+    std::chrono::steady_clock::time_point start;
+};
+
+// Options
+std::string host = "127.0.0.1";
+int port = 8080;
+int connectionCount = 50;
+double durationSeconds = 10;
+uint64_t requestLimit = 0;           // 0 = run for the duration
+bool keepAlive = true;
+std::vector<MixEntry> mix;
+std::string csvLabel;
+
+// Results
+LatencyHistogram histogram;
+uint64_t completed = 0;
+uint64_t errors = 0;
+uint64_t badStatus = 0;
+uint64_t bytesReceived = 0;
+uint64_t started = 0;
+
+std::mt19937 rng(12345);
+std::discrete_distribution<size_t> pick;
+int epollFd;
+sockaddr_in target;
+
+// "1k", "16K", "2m" -> bytes
+size_t parse_size(const std::string& text){
+    size_t value = std::stoul(text);
+    char unit = tolower(text.back());
+    if(unit == 'k') value *= 1024;
+    else if(unit == 'm') value *= 1024 * 1024;
+    return value;
+}
+
+// "a:3,b:1" -> [(a,3), (b,1)]; a missing weight means 1
+std::vector<std::pair<std::string, double>> parse_weighted(const std::string& text){
+    std::vector<std::pair<std::string, double>> items;
+    std::istringstream list(text);
+    std::string item;
+    while(std::getline(list, item, ',')){
+        if(item.empty()) continue;
+        size_t colon = item.rfind(':');
+        if(colon == std::string::npos) items.push_back({item, 1});
+        else items.push_back({item.substr(0, colon), std::stod(item.substr(colon + 1))});
+    }
+    return items;
+}
+
+std::string size_path(const std::string& size){
+    return "/loadgen/"+size+".bin";
+}
+
+bool populate(const std::string& directory, const std::vector<std::pair<std::string, double>>& sizes){
+    std::string folder = directory+"/loadgen";
+    mkdir(folder.c_str(), 0755);
+    for(auto& size : sizes){
+        std::string path = directory+size_path(size.first);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if(!file){
+            std::cerr<<"Cannot write "<<path<<"\n";
+            return false;
+        }
+        std::string block(65536, 'x');
+        size_t left = parse_size(size.first);
+        while(left > 0){
+            size_t chunk = std::min(left, block.size());
+            file.write(block.data(), chunk);
+            left -= chunk;
+        }
+        std::cout<<"Wrote "<<path<<"\n";
+    }
+    return true;
+}
+
+void close_conn(ClientConn& conn){
+    if(conn.fd >= 0){
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        conn.fd = -1;
+    }
+}
+
+bool time_left(std::chrono::steady_clock::time_point deadline){
+    if(requestLimit > 0) return started < requestLimit;
+    return std::chrono::steady_clock::now() < deadline;
+}
+
+bool open_conn(ClientConn& conn){
+    conn.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(conn.fd < 0) return false;
+    int opt = 1;
+    setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if(connect(conn.fd, (sockaddr*)&target, sizeof(target)) < 0 && errno != EINPROGRESS){
+        close(conn.fd);
+        conn.fd = -1;
+        return false;
+    }
+    conn.state = STATE_CONNECTING;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = &conn;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, conn.fd, &event);
+    return true;
+}
+
+void begin_request(ClientConn& conn){
+    const std::string& path = mix[pick(rng)].path;
+    conn.request = "GET "+path+" HTTP/1.1\r\nHost: "+host+"\r\n";
+    conn.request += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    conn.sent = 0;
+    conn.head.clear();
+    conn.headDone = false;
+    conn.bodyLeft = 0;
+    conn.status = 0;
+    conn.serverCloses = false;
+    conn.start = std::chrono::steady_clock::now();
+    started++;
+}
+
+// Take the status code, Content-Length and Connection header from a complete head.
+void parse_head(ClientConn& conn){
+    conn.status = atoi(conn.head.c_str() + 9);
+    std::istringstream lines(conn.head);
+    std::string line;
+    while(std::getline(lines, line)){
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        size_t colon = line.find(':');
+        if(colon == std::string::npos) continue;
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        if(name == "content-length") conn.bodyLeft = std::stoull(value);
+        else if(name == "connection" && (value == "close" || value == "Close")) conn.serverCloses = true;
+    }
+}
+
+// Start over on a fresh connection (connect failures, errors, Connection: close)
+void restart(ClientConn& conn, std::chrono::steady_clock::time_point deadline){
+    close_conn(conn);
+    if(!time_left(deadline)) return;
+    if(!open_conn(conn)){
+        errors++;
+        return;
+    }
+    begin_request(conn);
+}
+
+void finish_response(ClientConn& conn, std::chrono::steady_clock::time_point deadline){
+    auto elapsed = std::chrono::steady_clock::now() - conn.start;
+    histogram.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    completed++;
+    if(conn.status < 200 || conn.status >= 400) badStatus++;
+
+    if(!keepAlive || conn.serverCloses){
+        restart(conn, deadline);
+        return;
+    }
+    if(!time_left(deadline)){
+        close_conn(conn);
+        return;
+    }
+    begin_request(conn);
+    conn.state = STATE_SENDING;
+}
+
+void drive(ClientConn& conn, uint32_t events, std::chrono::steady_clock::time_point deadline){
+    static char buffer[READ_CHUNK_SIZE];
+    if(events & EPOLLERR){
+        errors++;
+        restart(conn, deadline);
+        return;
+    }
+    while(conn.fd >= 0){
+        if(conn.state == STATE_CONNECTING){
+            if(!(events & EPOLLOUT)) return;
+            conn.state = STATE_SENDING;
+        }
+        if(conn.state == STATE_SENDING){
+            ssize_t sent = send(conn.fd, conn.request.data() + conn.sent, conn.request.size() - conn.sent, MSG_NOSIGNAL);
+            if(sent < 0){
+                if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+                errors++;
+                restart(conn, deadline);
+                return;
+            }
+            conn.sent += sent;
+            if(conn.sent == conn.request.size()) conn.state = STATE_READING;
+            continue;
+        }
+
+        ssize_t got = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if(got < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            errors++;
+            restart(conn, deadline);
+            return;
+        }
+        if(got == 0){
+            // Server closed before the response was complete
+            errors++;
+            restart(conn, deadline);
+            return;
+        }
+        bytesReceived += got;
+        size_t used = 0;
+        if(!conn.headDone){
+            size_t before = conn.head.size();
+            conn.head.append(buffer, got);
+            size_t end = conn.head.find("\r\n\r\n", before >= 3 ? before - 3 : 0);
+            if(end == std::string::npos) continue;
+            used = end + 4 - before;
+            conn.head.resize(end + 4);
+            conn.headDone = true;
+            parse_head(conn);
+        }
+        size_t bodyBytes = std::min<size_t>(got - used, conn.bodyLeft);
+        conn.bodyLeft -= bodyBytes;
+        if(conn.bodyLeft == 0){
+            finish_response(conn, deadline);
+            if(conn.state == STATE_CONNECTING) return;   // reconnecting; wait for EPOLLOUT
+        }
+    }
+}
+
+void report(double elapsed){
+    double rps = completed / elapsed;
+    double mbps = bytesReceived / elapsed / (1024 * 1024);
+    if(!csvLabel.empty()){
+        std::cout<<csvLabel<<","<<connectionCount<<","<<(keepAlive ? "on" : "off")<<","<<completed<<","<<errors + badStatus<<","
+                 <<std::fixed<<std::setprecision(0)<<rps<<","<<std::setprecision(1)<<mbps<<","
+                 <<histogram.percentile(0.50)<<","<<histogram.percentile(0.99)<<","<<histogram.percentile(0.999)<<","<<histogram.maxValue<<"\n";
+        return;
+    }
+    std::cout<<"Requests:   "<<completed<<" in "<<std::fixed<<std::setprecision(2)<<elapsed<<" s ("
+             <<errors<<" connection errors, "<<badStatus<<" non-2xx/3xx)\n";
+    std::cout<<"Throughput: "<<std::setprecision(0)<<rps<<" req/s, "<<std::setprecision(1)<<mbps<<" MB/s\n";
+    std::cout<<"Latency:    p50 "<<histogram.percentile(0.50)<<" us, p99 "<<histogram.percentile(0.99)
+             <<" us, p99.9 "<<histogram.percentile(0.999)<<" us, max "<<histogram.maxValue<<" us\n";
+}
+
+void usage(const char* name){
+    std::cerr<<"Usage: "<<name<<" [--host <ip>] [--port <n>] [--connections <n>] [--duration <seconds> | --requests <n>]\n"
+             <<"       [--keepalive | --no-keepalive] [--mix <path[:weight],...>] [--size-dist <size[:weight],...>]\n"
+             <<"       [--populate <directory>] [--csv <label>]\n";
+}
+
+int main(int argc, char* argv[]){
+    std::vector<std::pair<std::string, double>> sizes;
+    std::string populateDir;
+    for(int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--host" && i+1 < argc) host = argv[++i];
+        else if(arg == "--port" && i+1 < argc) port = std::stoi(argv[++i]);
+        else if(arg == "--connections" && i+1 < argc) connectionCount = std::stoi(argv[++i]);
+        else if(arg == "--duration" && i+1 < argc) durationSeconds = std::stod(argv[++i]);
+        else if(arg == "--requests" && i+1 < argc) requestLimit = std::stoull(argv[++i]);
+        else if(arg == "--keepalive") keepAlive = true;
+        else if(arg == "--no-keepalive") keepAlive = false;
+        else if(arg == "--mix" && i+1 < argc){
+            for(auto& item : parse_weighted(argv[++i])) mix.push_back({item.first, item.second});
+        }
+        else if(arg == "--size-dist" && i+1 < argc) sizes = parse_weighted(argv[++i]);
+        else if(arg == "--populate" && i+1 < argc) populateDir = argv[++i];
+        else if(arg == "--csv" && i+1 < argc) csvLabel = argv[++i];
+        else{
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if(!populateDir.empty()) return populate(populateDir, sizes) ? 0 : 1;
+    for(auto& size : sizes) mix.push_back({size_path(size.first), size.second});
+    if(mix.empty()) mix.push_back({"/index.html", 1});
+    if(connectionCount < 1){
+        std::cerr<<"--connections must be at least 1\n";
+        return 1;
+    }
+
+    std::vector<double> weights;
+    for(MixEntry& entry : mix) weights.push_back(entry.weight);
+    pick = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+
+    signal(SIGPIPE, SIG_IGN);
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if(inet_pton(AF_INET, host.c_str(), &target.sin_addr) != 1){
+        std::cerr<<"Bad host address: "<<host<<"\n";
+        return 1;
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+
+    auto begin = std::chrono::steady_clock::now();
+    auto deadline = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(durationSeconds));
+    std::vector<ClientConn> conns(connectionCount);
+    for(ClientConn& conn : conns){
+        if(!time_left(deadline)) break;
+        if(!open_conn(conn)){
+            std::cerr<<"connect() failed: "<<strerror(errno)<<"\n";
+            return 1;
+        }
+        begin_request(conn);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    while(1){
+        bool active = false;
+        for(ClientConn& conn : conns) active = active || conn.fd >= 0;
+        if(!active) break;
+        // A request limit runs until the last response; a duration stops on time
+        if(requestLimit == 0 && std::chrono::steady_clock::now() >= deadline) break;
+
+        int readyCount = epoll_wait(epollFd, events, MAX_EVENTS, 100);
+        if(readyCount < 0){
+            if(errno == EINTR) continue;
+            std::cerr<<"epoll_wait() failed: "<<strerror(errno)<<"\n";
+            return 1;
+        }
+        for(int i = 0; i < readyCount; i++){
+            drive(*(ClientConn*)events[i].data.ptr, events[i].events, deadline);
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    report(elapsed.count());
+    return 0;
+}
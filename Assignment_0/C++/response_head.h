@@ -0,0 +1,231 @@
+// Response header building for the Linux static server.
+// Status lines and the extension -> Content-Type map are constexpr tables
+// laid out at compile time, and ResponseHead assembles a header block in a
+// fixed inline buffer, so building the headers of a response never touches
+// the heap. The head and the body stay separate buffers and are handed to
+// the kernel together as iovecs.
+
+#ifndef RESPONSE_HEAD_H
+#define RESPONSE_HEAD_H
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#define HEAD_CAPACITY 512            // inline; above every head the server builds on its own
+#define MIME_TABLE_SIZE 64           // power of two
+#define MIME_HASH_SEED 918129u       // chosen so the extensions below do not collide
+
+// ---------------------------------------------------------------------------
+// Status lines, indexed directly by code
+// ---------------------------------------------------------------------------
+
+struct StatusLine {
+    int code;
+    std::string_view line;
+};
+
+constexpr StatusLine statusLines[] = {
+    {200, "HTTP/1.1 200 OK\r\n"},
+    {206, "HTTP/1.1 206 Partial Content\r\n"},
+    {304, "HTTP/1.1 304 Not Modified\r\n"},
+    {400, "HTTP/1.1 400 Bad Request\r\n"},
+    {404, "HTTP/1.1 404 Not Found\r\n"},
+    {405, "HTTP/1.1 405 Method Not Allowed\r\n"},
+    {416, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
+    {429, "HTTP/1.1 429 Too Many Requests\r\n"},
+    {500, "HTTP/1.1 500 Internal Server Error\r\n"},
+    {503, "HTTP/1.1 503 Service Unavailable\r\n"},
+};
+
+constexpr int STATUS_COUNT = sizeof(statusLines) / sizeof(statusLines[0]);
+
+struct StatusIndex {
+    uint8_t slot[400];               // code - 200 -> index into statusLines, or 0xff
+};
+
+constexpr StatusIndex build_status_index(){
+    StatusIndex index{};
+    for(int code = 0; code < 400; code++) index.slot[code] = 0xff;
+    for(int i = 0; i < STATUS_COUNT; i++) index.slot[statusLines[i].code - 200] = i;
+    return index;
+}
+
+constexpr StatusIndex statusIndex = build_status_index();
+
+// Position of `code` in statusLines, or STATUS_COUNT if it is not listed.
+constexpr int status_index(int code){
+    if(code < 200 || code >= 600 || statusIndex.slot[code - 200] == 0xff) return STATUS_COUNT;
+    return statusIndex.slot[code - 200];
+}
+
+// Unknown codes are reported as 500 rather than sent malformed.
+constexpr std::string_view status_line(int code){
+    int index = status_index(code);
+    return index == STATUS_COUNT ? "HTTP/1.1 500 Internal Server Error\r\n" : statusLines[index].line;
+}
+
+static_assert(status_line(404) == "HTTP/1.1 404 Not Found\r\n", "status index is out of step with statusLines");
+
+// ---------------------------------------------------------------------------
+// Content types: a perfect hash over lower-cased extensions. The table is
+// filled at compile time and the build fails if two extensions collide.
+// ---------------------------------------------------------------------------
+
+struct MimeType {
+    std::string_view extension;
+    std::string_view type;
+};
+
+constexpr MimeType mimeTypes[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "application/javascript"},
+    {"mjs", "application/javascript"},
+    {"json", "application/json"},
+    {"map", "application/json"},
+    {"txt", "text/plain"},
+    {"csv", "text/csv"},
+    {"md", "text/markdown"},
+    {"xml", "application/xml"},
+    {"pdf", "application/pdf"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"svg", "image/svg+xml"},
+    {"ico", "image/x-icon"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"bmp", "image/bmp"},
+    {"wasm", "application/wasm"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"eot", "application/vnd.ms-fontobject"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"m4a", "audio/mp4"},
+    {"zip", "application/zip"},
+    {"tar", "application/x-tar"},
+    {"gz", "application/gzip"},
+};
+
+constexpr std::string_view DEFAULT_MIME_TYPE = "application/octet-stream";
+
+// FNV-1a followed by a final avalanche step
+constexpr uint32_t mime_hash(std::string_view extension){
+    uint32_t x = MIME_HASH_SEED;
+    for(char c : extension) x = (x ^ (unsigned char)c) * 16777619u;
+    x ^= x >> 15;
+    x *= 0x2c1b3c6du;
+    x ^= x >> 12;
+    return x & (MIME_TABLE_SIZE - 1);
+}
+
+struct MimeTable {
+    MimeType slots[MIME_TABLE_SIZE];
+    bool perfect;
+};
+
+constexpr MimeTable build_mime_table(){
+    MimeTable table{};
+    table.perfect = true;
+    for(const MimeType& mime : mimeTypes){
+        MimeType& slot = table.slots[mime_hash(mime.extension)];
+        if(!slot.extension.empty()) table.perfect = false;
+        slot = mime;
+    }
+    return table;
+}
+
+constexpr MimeTable mimeTable = build_mime_table();
+
+static_assert(mimeTable.perfect, "MIME extensions collide; pick another MIME_HASH_SEED");
+
+// Content-Type for a path, by its extension (case-insensitive).
+inline std::string_view mime_type(std::string_view path){
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if(dot == std::string_view::npos || (slash != std::string_view::npos && slash > dot)) return DEFAULT_MIME_TYPE;
+    std::string_view extension = path.substr(dot + 1);
+
+    char lower[8];
+    if(extension.empty() || extension.size() > sizeof(lower)) return DEFAULT_MIME_TYPE;
+    for(size_t i = 0; i < extension.size(); i++){
+        char c = extension[i];
+        lower[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    std::string_view key(lower, extension.size());
+    const MimeType& slot = mimeTable.slots[mime_hash(key)];
+    return slot.extension == key ? slot.type : DEFAULT_MIME_TYPE;
+}
+
+// ---------------------------------------------------------------------------
+// Header block in an inline buffer. A head that outgrows HEAD_CAPACITY
+// (long header values from a file name or a redirect, many ranges) moves to
+// the heap rather than being cut short.
+// ---------------------------------------------------------------------------
+
+struct ResponseHead {
+    size_t length = 0;
+    char bytes[HEAD_CAPACITY];
+    std::string overflow;            // the whole head, once it has outgrown `bytes`
+
+    ResponseHead() {}
+    ResponseHead(const ResponseHead& other) : length(other.length), overflow(other.overflow) {
+        if(overflow.empty()) memcpy(bytes, other.bytes, length);
+    }
+    ResponseHead& operator=(const ResponseHead& other){
+        length = other.length;
+        overflow = other.overflow;
+        if(overflow.empty()) memcpy(bytes, other.bytes, length);
+        return *this;
+    }
+
+    const char* data() const { return overflow.empty() ? bytes : overflow.data(); }
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    std::string_view view() const { return std::string_view(data(), length); }
+    void clear(){
+        length = 0;
+        overflow.clear();
+    }
+
+    ResponseHead& append(std::string_view text){
+        if(overflow.empty() && length + text.size() <= HEAD_CAPACITY){
+            memcpy(bytes + length, text.data(), text.size());
+        }
+        else{
+            if(overflow.empty()) overflow.assign(bytes, length);
+            overflow.append(text);
+        }
+        length += text.size();
+        return *this;
+    }
+
+    ResponseHead& append_number(uint64_t value){
+        char digits[20];
+        std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+        return append(std::string_view(digits, result.ptr - digits));
+    }
+
+    // "Name: value\r\n"
+    ResponseHead& header(std::string_view name, std::string_view value){
+        return append(name).append(": ").append(value).append("\r\n");
+    }
+
+    ResponseHead& header(std::string_view name, uint64_t value){
+        return append(name).append(": ").append_number(value).append("\r\n");
+    }
+};
+
+#endif
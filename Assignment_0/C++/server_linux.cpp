@@ -0,0 +1,2638 @@
+// Linux build of the Assignment 0 static file server.
+// Supports the original one-request-at-a-time loop (--engine serial) and a
+// non-blocking, edge-triggered epoll reactor (--engine epoll, the default),
+// and an io_uring completion loop (--engine uring).
+
+#include "http_parser.h"
+#include "response_head.h"
+#include "timer_wheel.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <ctime>
+#include <climits>
+
+#define BUFFER_SIZE 1024
+#define READ_CHUNK_SIZE 16384
+#define MAX_REQUEST_SIZE 65536
+#define MAX_EVENTS 1024
+#define MAX_PIPELINE 16
+#define MAX_RANGES 16
+#define MAX_CACHED_LISTINGS 64
+#define DEFAULT_LISTING_LIMIT 1000
+#define MAX_LISTING_LIMIT 10000
+#define LISTING_CHUNK_SIZE 16384
+#define LOG_RING_SIZE 16384          // power of two
+#define LOG_LINE_SIZE 200
+#define LOG_BATCH_SIZE 65536
+#define LOG_FLUSH_INTERVAL_US 20000
+#define STATS_PATH "/__stats"
+
+int INVALID_SOCKET = -1;
+int SOCKET_ERROR = -1;
+
+// Keep-alive limits and connection deadlines, overridable from the command line
+int keepAliveTimeout = 5;
+int maxKeepAliveRequests = 100;
+int headerTimeout = 10;          // seconds to deliver a complete request head
+int writeTimeout = 30;           // seconds a pending response may go without progress
+int maxConnectionsPerIp = 0;     // 0 = no cap
+
+// ---------------------------------------------------------------------------
+// Metrics. Each worker owns one WorkerStats block, aligned so workers never
+// share a cache line, and is the only thread that writes it: counters are
+// bumped with a relaxed load and store, never a locked read-modify-write.
+// Other threads (the stats reporter, /__stats on any worker) only read.
+// ---------------------------------------------------------------------------
+
+#define STAGE_BUCKETS 16
+
+enum Stage {
+    STAGE_PARSE,    // parsing a complete request head
+    STAGE_STAT,     // stat() of the requested path
+    STAGE_READ,     // opening the file or reading it, or loading a listing
+    STAGE_SEND,     // response queued until its last byte was handed to the kernel
+    STAGE_COUNT
+};
+
+const char* stageNames[STAGE_COUNT] = {"parse", "stat", "read", "send"};
+
+// Upper bounds of the latency buckets in microseconds; the last is +Inf
+constexpr uint64_t stageBucketBounds[STAGE_BUCKETS - 1] = {1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 100000};
+
+struct StageHistogram {
+    std::atomic<uint64_t> buckets[STAGE_BUCKETS]{};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sumNs{0};
+};
+
+struct WorkerStats {
+    alignas(64) std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> statusCounts[STATUS_COUNT + 1]{};   // last slot: codes not in statusLines
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<int64_t> activeConnections{0};
+    std::atomic<uint64_t> cacheHits{0};
+    std::atomic<uint64_t> cacheMisses{0};
+    StageHistogram stages[STAGE_COUNT];
+};
+
+thread_local WorkerStats* workerStats = nullptr;
+WorkerStats* allWorkerStats = nullptr;
+int allWorkerCount = 0;
+
+// Single-writer increment: no lock prefix, readers see a recent value.
+template <typename T>
+inline void bump(std::atomic<T>& counter, T amount = 1){
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+inline uint64_t now_ns(){
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void record_stage(Stage stage, uint64_t startNs){
+    uint64_t elapsed = now_ns() - startNs;
+    uint64_t micros = elapsed / 1000;
+    int bucket = 0;
+    while(bucket < STAGE_BUCKETS - 1 && micros >= stageBucketBounds[bucket]) bucket++;
+    StageHistogram& histogram = workerStats->stages[stage];
+    bump<uint64_t>(histogram.buckets[bucket]);
+    bump<uint64_t>(histogram.count);
+    bump(histogram.sumNs, elapsed);
+}
+
+void count_status(int statusCode){
+    bump<uint64_t>(workerStats->statusCounts[status_index(statusCode)]);
+}
+
+// ---------------------------------------------------------------------------
+// Access log: request paths push fixed-size binary records into a bounded
+// lock-free ring (Vyukov-style, one sequence number per slot) and never
+// format or write anything themselves. A background thread drains the ring,
+// formats a batch into one buffer and writes it with a single write() to
+// the log file (and stdout with --log-stdout). When the ring is full the
+// record is dropped and counted; the writer reports drops in the log.
+// ---------------------------------------------------------------------------
+
+enum LogFormat {
+    LOG_FORMAT_LEGACY,   // [ctime] [ip] request-line status
+    LOG_FORMAT_COMMON,   // Common Log Format
+    LOG_FORMAT_JSON      // one JSON object per line
+};
+
+struct LogRecord {
+    int64_t timestampNs;
+    uint16_t statusCode;
+    uint16_t requestLineLength;
+    char clientIp[INET_ADDRSTRLEN];
+    char requestLine[LOG_LINE_SIZE];
+};
+
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LogRecord record;
+};
+
+LogFormat logFormat = LOG_FORMAT_LEGACY;
+std::string logPath = "server.log";
+bool logToStdout = false;
+int logFd = -1;
+
+LogSlot* logRing = nullptr;
+alignas(64) std::atomic<size_t> logEnqueuePos{0};
+alignas(64) size_t logDequeuePos = 0;
+alignas(64) std::atomic<uint64_t> logDropped{0};
+
+// Every routed request passes through here exactly once, so this is also
+// where responses are counted by status.
+void log_request(const std::string& clientIp, std::string_view requestLine, int statusCode){
+    count_status(statusCode);
+    if(logRing == nullptr) return;
+
+    size_t pos = logEnqueuePos.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    while(1){
+        slot = &logRing[pos & (LOG_RING_SIZE - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if(diff == 0){
+            if(logEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        }
+        else if(diff < 0){
+            logDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else{
+            pos = logEnqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    LogRecord& record = slot->record;
+    timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record.timestampNs = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record.statusCode = statusCode;
+    size_t ipLength = std::min(clientIp.size(), sizeof(record.clientIp) - 1);
+    memcpy(record.clientIp, clientIp.data(), ipLength);
+    record.clientIp[ipLength] = '\0';
+    // Only the request line is logged, never the headers
+    size_t lineLength = std::min(requestLine.size(), sizeof(record.requestLine));
+    memcpy(record.requestLine, requestLine.data(), lineLength);
+    record.requestLineLength = lineLength;
+
+    slot->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void append_json_string(std::string& out, const char* text, size_t length){
+    out += '"';
+    for(size_t i = 0; i < length; i++){
+        unsigned char c = text[i];
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        }
+        else if(c < 0x20){
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else{
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+void format_log_record(const LogRecord& record, std::string& out){
+    time_t seconds = record.timestampNs / 1000000000;
+    tm parts;
+    char timestamp[64];
+    switch(logFormat){
+        case LOG_FORMAT_LEGACY:
+            localtime_r(&seconds, &parts);
+            strftime(timestamp, sizeof(timestamp), "%a %b %d %H:%M:%S %Y", &parts);
+            out += "[";
+            out += timestamp;
+            out += "] [";
+            out += record.clientIp;
+            out += "] ";
+            out.append(record.requestLine, record.requestLineLength);
+            out += " "+std::to_string(record.statusCode)+"\n";
+            break;
+        case LOG_FORMAT_COMMON:
+            gmtime_r(&seconds, &parts);
+            strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S +0000", &parts);
+            out += record.clientIp;
+            out += " - - [";
+            out += timestamp;
+            out += "] \"";
+            out.append(record.requestLine, record.requestLineLength);
+            out += "\" "+std::to_string(record.statusCode)+" -\n";
+            break;
+        case LOG_FORMAT_JSON:
+            gmtime_r(&seconds, &parts);
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &parts);
+            snprintf(timestamp + strlen(timestamp), 16, ".%03dZ", (int)(record.timestampNs / 1000000 % 1000));
+            out += "{\"time\":\"";
+            out += timestamp;
+            out += "\",\"ip\":\"";
+            out += record.clientIp;
+            out += "\",\"request\":";
+            append_json_string(out, record.requestLine, record.requestLineLength);
+            out += ",\"status\":"+std::to_string(record.statusCode)+"}\n";
+            break;
+    }
+}
+
+void write_fully(int fd, const std::string& data){
+    size_t done = 0;
+    while(done < data.size()){
+        ssize_t written = write(fd, data.data() + done, data.size() - done);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return;
+        done += written;
+    }
+}
+
+void access_log_writer(){
+    std::string batch;
+    batch.reserve(LOG_BATCH_SIZE + 1024);
+    uint64_t reportedDrops = 0;
+    while(1){
+        while(batch.size() < LOG_BATCH_SIZE){
+            LogSlot& slot = logRing[logDequeuePos & (LOG_RING_SIZE - 1)];
+            if(slot.sequence.load(std::memory_order_acquire) != logDequeuePos + 1) break;
+            format_log_record(slot.record, batch);
+            slot.sequence.store(logDequeuePos + LOG_RING_SIZE, std::memory_order_release);
+            logDequeuePos++;
+        }
+
+        uint64_t dropped = logDropped.load(std::memory_order_relaxed);
+        if(dropped != reportedDrops){
+            batch += "[access log] "+std::to_string(dropped - reportedDrops)+" records dropped (ring full)\n";
+            reportedDrops = dropped;
+        }
+
+        if(batch.empty()){
+            usleep(LOG_FLUSH_INTERVAL_US);
+            continue;
+        }
+        if(logFd >= 0) write_fully(logFd, batch);
+        if(logToStdout) write_fully(STDOUT_FILENO, batch);
+        bool full = batch.size() >= LOG_BATCH_SIZE;
+        batch.clear();
+        if(!full) usleep(LOG_FLUSH_INTERVAL_US);
+    }
+}
+
+void start_access_log(){
+    logFd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(logFd < 0){
+        std::cout<<"Could not open "<<logPath<<": "<<strerror(errno)<<"\n";
+    }
+    logRing = new LogSlot[LOG_RING_SIZE];
+    for(size_t i = 0; i < LOG_RING_SIZE; i++) logRing[i].sequence.store(i, std::memory_order_relaxed);
+    std::thread writer(access_log_writer);
+    writer.detach();
+}
+
+// A cached file: its bytes plus the pre-serialized status line,
+// Content-Type and Content-Length, shared by every response that uses it.
+struct CacheEntry {
+    std::string key;           // served path plus accepted-encoding flags
+    std::string path;          // file actually served (may be a .gz/.br sibling)
+    ResponseHead head;
+    std::string body;
+    std::string etag;
+    bool watched = false;      // covered by an inotify watch on its directory
+    timespec mtime = {0, 0};   // checked on every hit when not watched
+    off_t size = 0;
+};
+
+// One slice of the file to stream. `prefix` carries the part headers of a
+// multipart/byteranges body and is empty otherwise.
+struct FileRange {
+    std::string prefix;
+    off_t offset = 0;
+    size_t length = 0;
+    size_t mappedSent = 0;     // bytes sent from the file's mapping (--file-io mmap)
+};
+
+struct FileMapping;
+
+// A response is a header block plus a body that is held in memory (error
+// pages, listings), shared with the hot-file cache, or streamed straight
+// from a file with sendfile(), so file contents are never copied per request.
+// In-memory parts go out together in one writev-style sendmsg() call, so the
+// head and the body are never concatenated.
+struct ListingCursor;
+
+struct Response {
+    std::shared_ptr<const CacheEntry> cached;
+    std::shared_ptr<ListingCursor> listing;   // directory listing generated as it is sent
+    std::shared_ptr<const FileMapping> mapping;   // ranges are sent from here instead of fileFd
+    ResponseHead head;
+    std::string body;
+    int fileFd = -1;
+    std::vector<FileRange> ranges;  // consumed in place as they are sent
+    std::string trailer;            // closing multipart boundary, if any
+    size_t rangeIndex = 0;
+    size_t prefixSent = 0;
+    size_t trailerSent = 0;
+    size_t memorySent = 0;
+    uint64_t queuedNs = 0;          // when the head was finished, for the send stage
+};
+
+void build_head(ResponseHead& head, int statusCode, size_t contentLength, std::string_view contentType){
+    head.clear();
+    head.append(status_line(statusCode));
+    head.header("Content-Type", contentType);
+    head.header("Content-Length", contentLength);
+}
+
+// Close the header block once the connection's fate is known.
+void finish_head(Response& response, bool keepAlive){
+    response.queuedNs = now_ns();
+    if(keepAlive){
+        response.head.append("Connection: keep-alive\r\nKeep-Alive: timeout=").append_number(keepAliveTimeout)
+                     .append(", max=").append_number(maxKeepAliveRequests).append("\r\n\r\n");
+    }
+    else{
+        response.head.append("Connection: close\r\n\r\n");
+    }
+}
+
+Response build_response(int statusCode, std::string_view content, std::string_view contentType = "text/plain"){
+    Response response;
+    build_head(response.head, statusCode, content.size(), contentType);
+    response.body = content;
+    return response;
+}
+
+void release_response(Response& response){
+    if(response.fileFd != -1){
+        close(response.fileFd);
+        response.fileFd = -1;
+    }
+}
+
+// Defined with the directory listing code below
+bool refill_listing_body(Response& response);
+
+// Point `iov` at the in-memory bytes not yet sent: cached head, per-response
+// head, then cached or in-memory body. A streamed listing is refilled here
+// once its current chunk is out. Returns the number of iovecs, 0 when done.
+int response_iovecs(Response& response, iovec iov[3]){
+    while(1){
+        std::string_view parts[3] = {std::string_view(), response.head.view(), response.body};
+        if(response.cached){
+            parts[0] = response.cached->head.view();
+            parts[2] = response.cached->body;
+        }
+
+        int iovCount = 0;
+        size_t skip = response.memorySent;
+        for(std::string_view part : parts){
+            if(skip >= part.size()){
+                skip -= part.size();
+                continue;
+            }
+            iov[iovCount].iov_base = (void*)(part.data() + skip);
+            iov[iovCount].iov_len = part.size() - skip;
+            iovCount++;
+            skip = 0;
+        }
+        if(iovCount > 0 || !response.listing || !refill_listing_body(response)) return iovCount;
+    }
+}
+
+// Nothing follows the current range: no later range and no multipart trailer.
+bool last_file_part(const Response& response){
+    return response.rangeIndex + 1 >= response.ranges.size() && response.trailer.empty();
+}
+
+const char* mapping_data(const FileMapping& mapping);
+
+// Send the rest of the current range from the file's mapping, straight
+// from the mapped pages. False with errno set when the socket stops it.
+bool send_mapped(int socketFd, Response& response){
+    FileRange& range = response.ranges[response.rangeIndex];
+    const char* data = mapping_data(*response.mapping) + range.offset;
+    while(range.mappedSent < range.length){
+        ssize_t sent = send(socketFd, data + range.mappedSent, range.length - range.mappedSent, MSG_NOSIGNAL | (last_file_part(response) ? 0 : MSG_MORE));
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            return false;
+        }
+        bump<uint64_t>(workerStats->bytesSent, sent);
+        range.mappedSent += sent;
+    }
+    return true;
+}
+
+// Push as much of the response as the socket will take.
+// Returns 1 when fully sent, 0 when the socket would block, -1 on error.
+int pump_response(int socketFd, Response& response){
+    while(1){
+        iovec iov[3];
+        int iovCount = response_iovecs(response, iov);
+        if(iovCount == 0) break;
+
+        msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = iovCount;
+        ssize_t sent = sendmsg(socketFd, &message, MSG_NOSIGNAL | (response.rangeIndex < response.ranges.size() ? MSG_MORE : 0));
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        bump<uint64_t>(workerStats->bytesSent, sent);
+        response.memorySent += sent;
+    }
+    // File ranges go straight from the page cache with sendfile(), so memory
+    // per connection stays flat however large the file or the range is.
+    while(response.rangeIndex < response.ranges.size()){
+        FileRange& range = response.ranges[response.rangeIndex];
+        while(response.prefixSent < range.prefix.size()){
+            ssize_t sent = send(socketFd, range.prefix.data() + response.prefixSent, range.prefix.size() - response.prefixSent, MSG_NOSIGNAL | MSG_MORE);
+            if(sent < 0){
+                if(errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            bump<uint64_t>(workerStats->bytesSent, sent);
+            response.prefixSent += sent;
+        }
+        if(response.mapping){
+            if(!send_mapped(socketFd, response)) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            range.length = 0;
+        }
+        while(range.length > 0){
+            ssize_t sent = sendfile(socketFd, response.fileFd, &range.offset, range.length);
+            if(sent < 0){
+                if(errno == EINTR) continue;
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            }
+            if(sent == 0) return -1; // file shrank underneath us
+            bump<uint64_t>(workerStats->bytesSent, sent);
+            range.length -= sent;
+        }
+        response.rangeIndex++;
+        response.prefixSent = 0;
+    }
+    while(response.trailerSent < response.trailer.size()){
+        ssize_t sent = send(socketFd, response.trailer.data() + response.trailerSent, response.trailer.size() - response.trailerSent, MSG_NOSIGNAL);
+        if(sent < 0){
+            if(errno == EINTR) continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        bump<uint64_t>(workerStats->bytesSent, sent);
+        response.trailerSent += sent;
+    }
+    release_response(response);
+    response.cached.reset();
+    response.mapping.reset();
+    record_stage(STAGE_SEND, response.queuedNs);
+    return 1;
+}
+
+bool ends_with(const std::string& value, const std::string& ending) {
+    if (ending.size() > value.size()) {
+        return false;
+    }
+    return std::equal(ending.rbegin(), ending.rend(), value.rbegin());
+}
+
+// ---------------------------------------------------------------------------
+// Validators and precompressed variants. ETags are strong and derived from
+// inode, size and mtime; a sibling "file.br" or "file.gz" is served in place
+// of "file" when the client's Accept-Encoding allows it.
+// ---------------------------------------------------------------------------
+
+// The file picked to represent a path for one request, already open.
+struct FileVariant {
+    std::string path;
+    std::string encoding;   // "", "br" or "gzip"
+    int fileFd = -1;
+    struct stat fileStat;
+};
+
+#define ETAG_SIZE 80
+
+// Formats into the caller's buffer and returns a view of it.
+std::string_view make_etag(const struct stat& fileStat, char (&etag)[ETAG_SIZE]){
+    int length = snprintf(etag, ETAG_SIZE, "\"%llx-%llx-%llx.%lx\"", (unsigned long long)fileStat.st_ino, (unsigned long long)fileStat.st_size,
+                          (unsigned long long)fileStat.st_mtim.tv_sec, (unsigned long)fileStat.st_mtim.tv_nsec);
+    return std::string_view(etag, length);
+}
+
+void append_http_date(ResponseHead& head, time_t when){
+    char date[64];
+    tm parts;
+    gmtime_r(&when, &parts);
+    head.append(std::string_view(date, strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &parts)));
+}
+
+time_t parse_http_date(std::string_view text){
+    char date[64];
+    if(text.size() >= sizeof(date)) return -1;
+    memcpy(date, text.data(), text.size());
+    date[text.size()] = '\0';
+    tm parts{};
+    const char* end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    if(end == nullptr) return -1;
+    return timegm(&parts);
+}
+
+// ETag, Last-Modified and encoding headers describing the representation.
+void append_representation_headers(ResponseHead& head, const FileVariant& variant){
+    char etag[ETAG_SIZE];
+    head.header("ETag", make_etag(variant.fileStat, etag));
+    head.append("Last-Modified: ");
+    append_http_date(head, variant.fileStat.st_mtim.tv_sec);
+    head.append("\r\n");
+    if(!variant.encoding.empty()) head.header("Content-Encoding", variant.encoding);
+    head.append("Vary: Accept-Encoding\r\n");
+}
+
+// True if `coding` is listed in Accept-Encoding with a non-zero q-value.
+bool accepts_encoding(std::string_view acceptEncoding, std::string_view coding){
+    while(!acceptEncoding.empty()){
+        size_t comma = acceptEncoding.find(',');
+        std::string_view offer = acceptEncoding.substr(0, comma);
+        acceptEncoding = comma == std::string_view::npos ? std::string_view() : acceptEncoding.substr(comma + 1);
+
+        size_t semicolon = offer.find(';');
+        if(!iequals(trim(offer.substr(0, semicolon)), coding)) continue;
+        if(semicolon == std::string_view::npos) return true;
+        size_t q = offer.find("q=", semicolon);
+        if(q == std::string_view::npos) return true;
+        std::string_view weight = trim(offer.substr(q + 2));
+        return weight.find_first_not_of("0.") != std::string_view::npos;
+    }
+    return false;
+}
+
+// Value of `name` in a URL query string ("a=1&b=2"), or an empty view.
+std::string_view query_param(std::string_view query, std::string_view name){
+    while(!query.empty()){
+        size_t amp = query.find('&');
+        std::string_view pair = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+        size_t equals = pair.find('=');
+        if(pair.substr(0, equals) == name) return equals == std::string_view::npos ? std::string_view() : pair.substr(equals + 1);
+    }
+    return std::string_view();
+}
+
+// Cache-key suffix recording which precompressed variants the client accepts
+std::string encoding_flags(std::string_view acceptEncoding){
+    std::string flags;
+    if(accepts_encoding(acceptEncoding, "br")) flags += "b";
+    if(accepts_encoding(acceptEncoding, "gzip")) flags += "g";
+    return flags;
+}
+
+bool open_variant(const std::string& path, const std::string& encoding, FileVariant& variant){
+    int fileFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fileFd < 0) return false;
+    if(fstat(fileFd, &variant.fileStat) != 0 || (!encoding.empty() && !S_ISREG(variant.fileStat.st_mode))){
+        close(fileFd);
+        return false;
+    }
+    variant.path = path;
+    variant.encoding = encoding;
+    variant.fileFd = fileFd;
+    return true;
+}
+
+// Prefer br, then gzip, then the file itself.
+bool select_variant(const std::string& fullPath, const std::string& flags, FileVariant& variant){
+    if(flags.find('b') != std::string::npos && open_variant(fullPath+".br", "br", variant)) return true;
+    if(flags.find('g') != std::string::npos && open_variant(fullPath+".gz", "gzip", variant)) return true;
+    return open_variant(fullPath, "", variant);
+}
+
+bool etag_list_matches(std::string_view list, std::string_view etag){
+    if(list.find('*') != std::string::npos) return true;
+    // Weak comparison: a W/ prefix on a listed tag does not matter
+    size_t pos = 0;
+    while((pos = list.find(etag, pos)) != std::string_view::npos){
+        size_t end = pos + etag.size();
+        bool startOk = pos == 0 || list[pos-1] == ' ' || list[pos-1] == ',' || list[pos-1] == '/';
+        bool endOk = end == list.size() || list[end] == ' ' || list[end] == ',';
+        if(startOk && endOk) return true;
+        pos = end;
+    }
+    return false;
+}
+
+// If-None-Match wins over If-Modified-Since when both are present.
+bool not_modified(const HttpRequest& request, std::string_view etag, time_t lastModified){
+    std::string_view ifNoneMatch = request.header("If-None-Match");
+    if(!ifNoneMatch.empty()) return etag_list_matches(ifNoneMatch, etag);
+    std::string_view ifModifiedSince = request.header("If-Modified-Since");
+    if(ifModifiedSince.empty()) return false;
+    time_t since = parse_http_date(ifModifiedSince);
+    return since != -1 && lastModified <= since;
+}
+
+Response not_modified_response(std::string_view etag, time_t lastModified){
+    Response response;
+    response.head.append(status_line(304)).header("ETag", etag).append("Last-Modified: ");
+    append_http_date(response.head, lastModified);
+    response.head.append("\r\nVary: Accept-Encoding\r\n");
+    return response;
+}
+
+// If-Range keeps a Range request valid only while the representation is unchanged.
+bool range_still_valid(const HttpRequest& request, std::string_view etag, time_t lastModified){
+    std::string_view ifRange = request.header("If-Range");
+    if(ifRange.empty()) return true;
+    if(ifRange[0] == '"') return ifRange == etag;
+    return parse_http_date(ifRange) == lastModified;
+}
+
+// ---------------------------------------------------------------------------
+// Hot-file cache: small files are kept in memory together with their
+// pre-serialized headers, so a hit is served with a single sendmsg() and no
+// stat/open/read. Eviction is CLOCK over a slot array bounded by total bytes.
+// Entries are invalidated by inotify watches on their parent directories;
+// if a watch cannot be added, the entry falls back to an mtime check per hit.
+// Entries are handed out as shared_ptr so in-flight responses stay valid
+// across eviction.
+// ---------------------------------------------------------------------------
+
+struct CacheSlot {
+    std::shared_ptr<const CacheEntry> entry;
+    bool referenced = false;
+};
+
+size_t cacheCapacity = 64 * 1024 * 1024;
+size_t cacheMaxFileSize = 1024 * 1024;
+
+// Each worker thread owns its cache and inotify instance
+thread_local size_t cacheBytes = 0;
+thread_local size_t clockHand = 0;
+thread_local std::vector<CacheSlot> cacheSlots;
+thread_local std::vector<size_t> freeSlots;
+thread_local std::unordered_map<std::string, size_t> cacheIndex;
+
+thread_local int inotifyFd = -1;
+thread_local std::unordered_map<int, std::vector<std::string>> watchDirs;
+thread_local std::unordered_map<std::string, int> dirWatches;
+
+void cache_remove_slot(size_t slot){
+    CacheSlot& cacheSlot = cacheSlots[slot];
+    cacheBytes -= cacheSlot.entry->body.size();
+    cacheIndex.erase(cacheSlot.entry->key);
+    cacheSlot.entry.reset();
+    cacheSlot.referenced = false;
+    freeSlots.push_back(slot);
+}
+
+void cache_invalidate_key(const std::string& key){
+    auto it = cacheIndex.find(key);
+    if(it != cacheIndex.end()) cache_remove_slot(it->second);
+}
+
+// A change to a file or to one of its precompressed siblings drops every
+// encoding variant cached for that file.
+void cache_invalidate(const std::string& path){
+    std::string base = path;
+    if(ends_with(base, ".gz") || ends_with(base, ".br")) base.resize(base.size() - 3);
+    for(const char* flags : {"", "b", "g", "bg"}) cache_invalidate_key(base+"\n"+flags);
+}
+
+void cache_clear(){
+    for(size_t slot = 0; slot < cacheSlots.size(); slot++){
+        if(cacheSlots[slot].entry) cache_remove_slot(slot);
+    }
+}
+
+bool watch_directory(const std::string& dir){
+    if(inotifyFd < 0) return false;
+    if(dirWatches.count(dir)) return true;
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(), IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if(wd < 0) return false;
+    dirWatches[dir] = wd;
+    watchDirs[wd].push_back(dir);
+    return true;
+}
+
+// Drain pending inotify events and drop the entries they name.
+void process_cache_invalidations(){
+    if(inotifyFd < 0) return;
+    alignas(inotify_event) char buffer[4096];
+    while(1){
+        ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+        if(length <= 0) return;
+        for(char* ptr = buffer; ptr < buffer + length; ){
+            inotify_event* event = (inotify_event*)ptr;
+            ptr += sizeof(inotify_event) + event->len;
+            if(event->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)){
+                // Lost events or the directory itself went away: start over
+                cache_clear();
+                if(event->mask & IN_IGNORED){
+                    for(const std::string& dir : watchDirs[event->wd]) dirWatches.erase(dir);
+                    watchDirs.erase(event->wd);
+                }
+                continue;
+            }
+            if(event->len == 0) continue;
+            auto it = watchDirs.find(event->wd);
+            if(it == watchDirs.end()) continue;
+            for(const std::string& dir : it->second) cache_invalidate(dir+"/"+event->name);
+        }
+    }
+}
+
+void init_file_cache(){
+    if(cacheCapacity == 0) return;
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotifyFd < 0){
+        std::cout<<"inotify_init1() failed, falling back to mtime checks: "<<strerror(errno)<<"\n";
+    }
+}
+
+std::shared_ptr<const CacheEntry> cache_lookup(const std::string& key){
+    auto it = cacheIndex.find(key);
+    if(it == cacheIndex.end()) return nullptr;
+    CacheSlot& cacheSlot = cacheSlots[it->second];
+    if(!cacheSlot.entry->watched){
+        struct stat fileStat;
+        if(stat(cacheSlot.entry->path.c_str(), &fileStat) != 0 || fileStat.st_size != cacheSlot.entry->size
+           || fileStat.st_mtim.tv_sec != cacheSlot.entry->mtime.tv_sec || fileStat.st_mtim.tv_nsec != cacheSlot.entry->mtime.tv_nsec){
+            cache_remove_slot(it->second);
+            return nullptr;
+        }
+    }
+    cacheSlot.referenced = true;
+    return cacheSlot.entry;
+}
+
+// Advance the clock hand, giving referenced entries a second chance,
+// until `needed` more bytes fit.
+void cache_make_room(size_t needed){
+    while(cacheBytes + needed > cacheCapacity && cacheBytes > 0){
+        if(clockHand >= cacheSlots.size()) clockHand = 0;
+        CacheSlot& cacheSlot = cacheSlots[clockHand];
+        if(cacheSlot.entry){
+            if(cacheSlot.referenced) cacheSlot.referenced = false;
+            else cache_remove_slot(clockHand);
+        }
+        clockHand++;
+    }
+}
+
+void cache_insert(std::shared_ptr<const CacheEntry> entry){
+    cache_invalidate_key(entry->key);
+    cache_make_room(entry->body.size());
+    size_t slot;
+    if(!freeSlots.empty()){
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    else{
+        slot = cacheSlots.size();
+        cacheSlots.emplace_back();
+    }
+    cacheSlots[slot].entry = entry;
+    cacheSlots[slot].referenced = false;
+    cacheIndex[entry->key] = slot;
+    cacheBytes += entry->body.size();
+}
+
+// Read a small file once and admit it to the cache. The directory watch is
+// added before reading so a write that races with the read still
+// invalidates the entry. Returns nullptr if the file cannot be cached.
+std::shared_ptr<const CacheEntry> cache_fill(const std::string& key, const std::string& fullPath, const FileVariant& variant){
+    const struct stat& fileStat = variant.fileStat;
+    int fileFd = variant.fileFd;
+    if(cacheCapacity == 0 || (size_t)fileStat.st_size > cacheMaxFileSize || (size_t)fileStat.st_size > cacheCapacity) return nullptr;
+
+    auto entry = std::make_shared<CacheEntry>();
+    entry->key = key;
+    entry->path = variant.path;
+    char etag[ETAG_SIZE];
+    entry->etag = make_etag(fileStat, etag);
+    entry->size = fileStat.st_size;
+    entry->mtime = fileStat.st_mtim;
+    size_t slash = variant.path.rfind('/');
+    entry->watched = slash != std::string::npos && watch_directory(variant.path.substr(0, slash));
+
+    entry->body.resize(fileStat.st_size);
+    size_t done = 0;
+    while(done < entry->body.size()){
+        ssize_t got = pread(fileFd, &entry->body[done], entry->body.size() - done, done);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return nullptr;
+        done += got;
+    }
+    build_head(entry->head, 200, entry->body.size(), mime_type(fullPath));
+    entry->head.append("Accept-Ranges: bytes\r\n");
+    append_representation_headers(entry->head, variant);
+    cache_insert(entry);
+    return entry;
+}
+
+// ---------------------------------------------------------------------------
+// Mapping cache (--file-io mmap). Files too big for the hot-file cache are
+// mapped once and the mapping is shared by every worker and every response
+// that sends the file, instead of each send going through sendfile(). The
+// cache is an LRU bounded by mapped bytes (--mmap-cache MB) behind one mutex
+// that is only taken to look a file up, never while sending. Mappings are
+// handed out as shared_ptr, so an evicted mapping is unmapped only after the
+// last in-flight response using it has finished. Entries are keyed by device
+// and inode and checked against the size and mtime of the file just opened,
+// so a replaced or rewritten file gets a fresh mapping.
+// ---------------------------------------------------------------------------
+
+#define MMAP_WILLNEED_LIMIT (4 * 1024 * 1024)   // smaller files are read ahead in full
+
+struct FileMapping {
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    timespec mtime = {0, 0};
+    char* data = nullptr;
+
+    ~FileMapping(){
+        if(data) munmap(data, size);
+    }
+};
+
+const char* mapping_data(const FileMapping& mapping){
+    return mapping.data;
+}
+
+bool mmapFiles = false;
+size_t mappingCapacity = 1024ull * 1024 * 1024;
+
+// Inode numbers are only unique within one filesystem
+struct FileId {
+    dev_t device;
+    ino_t inode;
+
+    bool operator==(const FileId& other) const {
+        return device == other.device && inode == other.inode;
+    }
+};
+
+struct FileIdHash {
+    size_t operator()(const FileId& id) const {
+        return std::hash<ino_t>()(id.inode) ^ (std::hash<dev_t>()(id.device) * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+struct MappingCache {
+    std::mutex lock;
+    std::list<std::shared_ptr<const FileMapping>> order;   // most recently used first
+    std::unordered_map<FileId, std::list<std::shared_ptr<const FileMapping>>::iterator, FileIdHash> index;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+MappingCache mappingCache;
+
+// Caller holds the lock.
+void mapping_erase(std::list<std::shared_ptr<const FileMapping>>::iterator it){
+    mappingCache.bytes -= (*it)->size;
+    mappingCache.index.erase(FileId{(*it)->device, (*it)->inode});
+    mappingCache.order.erase(it);
+}
+
+bool mapping_matches(const FileMapping& mapping, const struct stat& fileStat){
+    return mapping.device == fileStat.st_dev && mapping.inode == fileStat.st_ino && mapping.size == fileStat.st_size
+        && mapping.mtime.tv_sec == fileStat.st_mtim.tv_sec && mapping.mtime.tv_nsec == fileStat.st_mtim.tv_nsec;
+}
+
+// The shared mapping of an open file, mapping it on a miss. Returns nullptr
+// if the file cannot be mapped (empty, or mmap failed), in which case the
+// caller sends it with sendfile() as usual.
+std::shared_ptr<const FileMapping> map_file(const FileVariant& variant){
+    const struct stat& fileStat = variant.fileStat;
+    if(fileStat.st_size == 0) return nullptr;
+    {
+        std::lock_guard<std::mutex> guard(mappingCache.lock);
+        auto found = mappingCache.index.find(FileId{fileStat.st_dev, fileStat.st_ino});
+        if(found != mappingCache.index.end()){
+            if(mapping_matches(**found->second, fileStat)){
+                mappingCache.hits++;
+                mappingCache.order.splice(mappingCache.order.begin(), mappingCache.order, found->second);
+                return *found->second;
+            }
+            mapping_erase(found->second);   // stale: responses still holding it keep it alive
+        }
+        mappingCache.misses++;
+    }
+
+    // Map outside the lock; another worker may race us to the same file,
+    // in which case the first mapping inserted wins
+    void* data = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_SHARED, variant.fileFd, 0);
+    if(data == MAP_FAILED) return nullptr;
+    // Small files are read ahead in full; large ones are streamed, so the
+    // kernel should read ahead aggressively and drop pages behind the reader.
+    madvise(data, fileStat.st_size, fileStat.st_size <= MMAP_WILLNEED_LIMIT ? MADV_WILLNEED : MADV_SEQUENTIAL);
+
+    auto mapping = std::make_shared<FileMapping>();
+    mapping->device = fileStat.st_dev;
+    mapping->inode = fileStat.st_ino;
+    mapping->size = fileStat.st_size;
+    mapping->mtime = fileStat.st_mtim;
+    mapping->data = (char*)data;
+    if((size_t)fileStat.st_size > mappingCapacity) return mapping;   // used once, never cached
+
+    std::lock_guard<std::mutex> guard(mappingCache.lock);
+    auto found = mappingCache.index.find(FileId{fileStat.st_dev, fileStat.st_ino});
+    if(found != mappingCache.index.end() && mapping_matches(**found->second, fileStat)) return *found->second;
+    if(found != mappingCache.index.end()) mapping_erase(found->second);
+    while(mappingCache.bytes + mapping->size > mappingCapacity && !mappingCache.order.empty()){
+        mapping_erase(std::prev(mappingCache.order.end()));
+    }
+    mappingCache.order.push_front(mapping);
+    mappingCache.index[FileId{mapping->device, mapping->inode}] = mappingCache.order.begin();
+    mappingCache.bytes += mapping->size;
+    return mapping;
+}
+
+// Parse a "bytes=" Range header against a file of `fileSize` bytes.
+// Returns 1 with `ranges` filled, 0 if the header should be ignored (absent,
+// malformed or too many parts, so the full file is sent) and -1 if no range
+// is satisfiable (416).
+int parse_ranges(std::string_view rangeHeader, off_t fileSize, std::vector<FileRange>& ranges){
+    if(rangeHeader.substr(0, 6) != "bytes=") return 0;
+    std::istringstream specs(std::string(rangeHeader.substr(6)));
+    std::string spec;
+    bool anySyntax = false;
+    while(std::getline(specs, spec, ',')){
+        size_t first = spec.find_first_not_of(" \t");
+        size_t last = spec.find_last_not_of(" \t");
+        if(first == std::string::npos) continue;
+        spec = spec.substr(first, last-first+1);
+        size_t dash = spec.find('-');
+        if(dash == std::string::npos) return 0;
+        std::string startText = spec.substr(0, dash), endText = spec.substr(dash+1);
+        if(startText.find_first_not_of("0123456789") != std::string::npos || endText.find_first_not_of("0123456789") != std::string::npos) return 0;
+        if(startText.empty() && endText.empty()) return 0;
+        if(startText.size() > 18 || endText.size() > 18) return 0;
+        anySyntax = true;
+
+        FileRange range;
+        if(startText.empty()){
+            // Suffix range: the last N bytes
+            off_t suffix = std::stoll(endText);
+            if(suffix == 0) continue;
+            range.offset = suffix >= fileSize ? 0 : fileSize - suffix;
+            range.length = fileSize - range.offset;
+        }
+        else{
+            off_t start = std::stoll(startText);
+            off_t end = endText.empty() ? fileSize - 1 : std::min<off_t>(std::stoll(endText), fileSize - 1);
+            if(!endText.empty() && std::stoll(endText) < start) return 0;
+            if(start >= fileSize) continue;
+            range.offset = start;
+            range.length = end - start + 1;
+        }
+        ranges.push_back(range);
+        if(ranges.size() > MAX_RANGES){
+            ranges.clear();
+            return 0;
+        }
+    }
+    if(!anySyntax) return 0;
+    return ranges.empty() ? -1 : 1;
+}
+
+thread_local int rangeBoundaryCounter = 0;
+
+// Give the response its body source: the shared mapping in mmap mode (the
+// descriptor is no longer needed then), the open descriptor otherwise.
+void attach_file_body(Response& response, const FileVariant& variant){
+    if(mmapFiles && S_ISREG(variant.fileStat.st_mode)){
+        response.mapping = map_file(variant);
+        if(response.mapping){
+            close(variant.fileFd);
+            return;
+        }
+    }
+    response.fileFd = variant.fileFd;
+}
+
+// Build a 206 response for the given ranges: a plain body with
+// Content-Range for one range, multipart/byteranges for several.
+Response range_response(const std::string& fullPath, const FileVariant& variant, std::vector<FileRange> ranges){
+    Response response;
+    off_t fileSize = variant.fileStat.st_size;
+    attach_file_body(response, variant);
+    std::string_view contentType = mime_type(fullPath);
+    if(ranges.size() == 1){
+        FileRange& range = ranges[0];
+        build_head(response.head, 206, range.length, contentType);
+        response.head.append("Content-Range: bytes ").append_number(range.offset).append("-").append_number(range.offset + range.length - 1)
+                     .append("/").append_number(fileSize).append("\r\nAccept-Ranges: bytes\r\n");
+        append_representation_headers(response.head, variant);
+        response.ranges = std::move(ranges);
+        return response;
+    }
+
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "BYTERANGE%08x%04x", (unsigned)time(nullptr), rangeBoundaryCounter++ & 0xffff);
+    size_t contentLength = 0;
+    for(FileRange& range : ranges){
+        range.prefix = "\r\n--"+std::string(boundary)+"\r\nContent-Type: "+std::string(contentType)+"\r\nContent-Range: bytes "
+                       +std::to_string(range.offset)+"-"+std::to_string(range.offset + range.length - 1)+"/"+std::to_string(fileSize)+"\r\n\r\n";
+        contentLength += range.prefix.size() + range.length;
+    }
+    response.trailer = "\r\n--"+std::string(boundary)+"--\r\n";
+    contentLength += response.trailer.size();
+    char multipartType[64];
+    int typeLength = snprintf(multipartType, sizeof(multipartType), "multipart/byteranges; boundary=%s", boundary);
+    build_head(response.head, 206, contentLength, std::string_view(multipartType, typeLength));
+    response.head.append("Accept-Ranges: bytes\r\n");
+    append_representation_headers(response.head, variant);
+    response.ranges = std::move(ranges);
+    return response;
+}
+
+Response file_response(const std::string& fullPath, const HttpRequest& request, const std::string& cacheKey, int& statusCode){
+    FileVariant variant;
+    if(!select_variant(fullPath, cacheKey.substr(cacheKey.rfind('\n') + 1), variant)){
+        statusCode = 404;
+        return build_response(404, "<h1>404 Not Found</h1>", "text/html");
+    }
+    const struct stat& fileStat = variant.fileStat;
+    int fileFd = variant.fileFd;
+    char etagBuffer[ETAG_SIZE];
+    std::string_view etag = make_etag(fileStat, etagBuffer);
+
+    if(not_modified(request, etag, fileStat.st_mtim.tv_sec)){
+        close(fileFd);
+        statusCode = 304;
+        return not_modified_response(etag, fileStat.st_mtim.tv_sec);
+    }
+
+    std::string_view rangeHeader = request.header("Range");
+    if(!rangeHeader.empty() && S_ISREG(fileStat.st_mode) && range_still_valid(request, etag, fileStat.st_mtim.tv_sec)){
+        std::vector<FileRange> ranges;
+        int result = parse_ranges(rangeHeader, fileStat.st_size, ranges);
+        if(result > 0){
+            statusCode = 206;
+            return range_response(fullPath, variant, std::move(ranges));
+        }
+        if(result < 0){
+            close(fileFd);
+            statusCode = 416;
+            Response response = build_response(416, "<h1>416 Range Not Satisfiable</h1>", "text/html");
+            response.head.append("Content-Range: bytes */").append_number(fileStat.st_size).append("\r\n");
+            return response;
+        }
+    }
+
+    statusCode = 200;
+    Response response;
+    if(S_ISREG(fileStat.st_mode)){
+        response.cached = cache_fill(cacheKey, fullPath, variant);
+        if(response.cached){
+            close(fileFd);
+            return response;
+        }
+    }
+    build_head(response.head, 200, fileStat.st_size, mime_type(fullPath));
+    response.head.append("Accept-Ranges: bytes\r\n");
+    append_representation_headers(response.head, variant);
+    attach_file_body(response, variant);
+    FileRange whole;
+    whole.length = fileStat.st_size;
+    response.ranges.push_back(whole);
+    return response;
+}
+
+// ---------------------------------------------------------------------------
+// Directory listings. The sorted entry list of a directory is cached per
+// worker and reused until the directory's mtime (which route_request() has
+// already stat()ed) changes. A request asks for one page of it with
+// ?offset=&limit= (and ?format=json for JSON); the page is formatted in
+// small chunks as the socket drains, so even a listing of a directory with
+// hundreds of thousands of files costs bounded time and memory per request.
+// ---------------------------------------------------------------------------
+
+struct DirEntryRef {
+    uint32_t offset;    // into DirListing::names
+    uint32_t length;
+    bool isDir;
+};
+
+struct DirListing {
+    std::string names;                  // every name back to back
+    std::vector<DirEntryRef> entries;   // sorted by name
+    timespec mtime = {0, 0};
+    std::string error;
+
+    std::string_view name(const DirEntryRef& entry) const {
+        return std::string_view(names.data() + entry.offset, entry.length);
+    }
+};
+
+struct ListingCursor {
+    std::shared_ptr<const DirListing> dir;
+    std::string requestPath;
+    size_t offset = 0;
+    size_t limit = 0;
+    size_t next = 0;
+    size_t end = 0;
+    bool json = false;
+    int stage = 0;      // 0 prologue, 1 entries, 2 epilogue, 3 done
+};
+
+thread_local std::unordered_map<std::string, std::shared_ptr<const DirListing>> listingCache;
+thread_local std::deque<std::string> listingOrder;
+
+std::shared_ptr<const DirListing> load_listing(const std::string& fullPath, const struct stat& dirStat){
+    auto it = listingCache.find(fullPath);
+    if(it != listingCache.end() && it->second->mtime.tv_sec == dirStat.st_mtim.tv_sec && it->second->mtime.tv_nsec == dirStat.st_mtim.tv_nsec){
+        return it->second;
+    }
+
+    auto listing = std::make_shared<DirListing>();
+    listing->mtime = dirStat.st_mtim;
+    DIR* dir = opendir(fullPath.c_str());
+    if(dir == nullptr){
+        listing->error = strerror(errno);
+    }
+    else{
+        std::vector<DirEntryRef> unsorted;
+        while(dirent* entry = readdir(dir)){
+            if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+            DirEntryRef ref;
+            ref.offset = listing->names.size();
+            ref.length = strlen(entry->d_name);
+            ref.isDir = entry->d_type == DT_DIR;
+            listing->names.append(entry->d_name, ref.length);
+            unsorted.push_back(ref);
+        }
+        closedir(dir);
+        const DirListing& names = *listing;
+        std::sort(unsorted.begin(), unsorted.end(), [&](const DirEntryRef& a, const DirEntryRef& b){
+            return names.name(a) < names.name(b);
+        });
+        listing->entries = std::move(unsorted);
+    }
+
+    if(it == listingCache.end()){
+        if(listingOrder.size() >= MAX_CACHED_LISTINGS){
+            listingCache.erase(listingOrder.front());
+            listingOrder.pop_front();
+        }
+        listingOrder.push_back(fullPath);
+    }
+    listingCache[fullPath] = listing;
+    return listing;
+}
+
+// Append `text` escaped for HTML or JSON to `out`, or with `out` == nullptr
+// only count the bytes, so Content-Length and the body always agree.
+size_t append_escaped(std::string* out, std::string_view text, bool json){
+    size_t length = 0;
+    for(char c : text){
+        const char* replacement = nullptr;
+        char unicodeEscape[8];
+        if(json){
+            if(c == '"') replacement = "\\\"";
+            else if(c == '\\') replacement = "\\\\";
+            else if((unsigned char)c < 0x20){
+                snprintf(unicodeEscape, sizeof(unicodeEscape), "\\u%04x", (unsigned char)c);
+                replacement = unicodeEscape;
+            }
+        }
+        else{
+            if(c == '<') replacement = "&lt;";
+            else if(c == '>') replacement = "&gt;";
+            else if(c == '&') replacement = "&amp;";
+            else if(c == '"') replacement = "&quot;";
+        }
+        if(replacement){
+            length += strlen(replacement);
+            if(out) out->append(replacement);
+        }
+        else{
+            length++;
+            if(out) out->push_back(c);
+        }
+    }
+    return length;
+}
+
+size_t append_text(std::string* out, std::string_view text){
+    if(out) out->append(text);
+    return text.size();
+}
+
+size_t append_listing_entry(std::string* out, const ListingCursor& cursor, size_t index){
+    const DirEntryRef& entry = cursor.dir->entries[index];
+    std::string_view name = cursor.dir->name(entry);
+    size_t length = 0;
+    if(cursor.json){
+        length += append_text(out, index == cursor.offset ? "{\"name\":\"" : ",{\"name\":\"");
+        length += append_escaped(out, name, true);
+        length += append_text(out, entry.isDir ? "\",\"dir\":true}" : "\",\"dir\":false}");
+    }
+    else{
+        length += append_text(out, "<li>");
+        length += append_escaped(out, name, false);
+        length += append_text(out, entry.isDir ? "/</li>" : "</li>");
+    }
+    return length;
+}
+
+size_t append_listing_prologue(std::string* out, const ListingCursor& cursor){
+    size_t length = 0;
+    if(cursor.json){
+        length += append_text(out, "{\"path\":\"");
+        length += append_escaped(out, cursor.requestPath, true);
+        std::string counts = "\",\"offset\":"+std::to_string(cursor.offset)+",\"limit\":"+std::to_string(cursor.limit)+",\"total\":"+std::to_string(cursor.dir->entries.size());
+        length += append_text(out, counts);
+        if(!cursor.dir->error.empty()){
+            length += append_text(out, ",\"error\":\"");
+            length += append_escaped(out, cursor.dir->error, true);
+            length += append_text(out, "\"");
+        }
+        length += append_text(out, ",\"entries\":[");
+    }
+    else{
+        length += append_text(out, "<html><body><h1>Directory Listing</h1><ul>");
+        if(!cursor.dir->error.empty()){
+            length += append_text(out, "<li>Error reading directory: ");
+            length += append_escaped(out, cursor.dir->error, false);
+            length += append_text(out, "</li>");
+        }
+    }
+    return length;
+}
+
+size_t append_listing_epilogue(std::string* out, const ListingCursor& cursor){
+    if(cursor.json) return append_text(out, "]}");
+    size_t length = append_text(out, "</ul>");
+    if(cursor.offset > 0){
+        size_t previous = cursor.offset > cursor.limit ? cursor.offset - cursor.limit : 0;
+        length += append_text(out, "<p><a href=\"?offset="+std::to_string(previous)+"&amp;limit="+std::to_string(cursor.limit)+"\">Previous</a></p>");
+    }
+    if(cursor.end < cursor.dir->entries.size()){
+        length += append_text(out, "<p><a href=\"?offset="+std::to_string(cursor.end)+"&amp;limit="+std::to_string(cursor.limit)+"\">Next</a></p>");
+    }
+    return length + append_text(out, "</body></html>");
+}
+
+// Replace the spent in-memory parts of `response` with the next chunk of
+// the listing. Returns false once the whole page has been produced.
+bool refill_listing_body(Response& response){
+    ListingCursor& cursor = *response.listing;
+    response.cached.reset();
+    response.head.clear();
+    response.body.clear();
+    response.memorySent = 0;
+    while(response.body.size() < LISTING_CHUNK_SIZE && cursor.stage < 3){
+        if(cursor.stage == 0){
+            append_listing_prologue(&response.body, cursor);
+            cursor.stage = 1;
+        }
+        else if(cursor.stage == 1){
+            if(cursor.next < cursor.end) append_listing_entry(&response.body, cursor, cursor.next++);
+            else cursor.stage = 2;
+        }
+        else{
+            append_listing_epilogue(&response.body, cursor);
+            cursor.stage = 3;
+        }
+    }
+    if(response.body.empty()){
+        response.listing.reset();
+        return false;
+    }
+    return true;
+}
+
+size_t query_number(std::string_view query, std::string_view name, size_t fallback){
+    std::string_view value = query_param(query, name);
+    if(value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string_view::npos) return fallback;
+    return std::stoull(std::string(value));
+}
+
+Response directory_listing_response(const std::string& fullPath, const struct stat& dirStat, std::string_view requestPath, std::string_view query){
+    auto cursor = std::make_shared<ListingCursor>();
+    cursor->dir = load_listing(fullPath, dirStat);
+    cursor->requestPath = requestPath;
+    cursor->json = query_param(query, "format") == "json";
+    cursor->limit = std::min<size_t>(std::max<size_t>(query_number(query, "limit", DEFAULT_LISTING_LIMIT), 1), MAX_LISTING_LIMIT);
+    cursor->offset = std::min(query_number(query, "offset", 0), cursor->dir->entries.size());
+    cursor->next = cursor->offset;
+    cursor->end = std::min(cursor->offset + cursor->limit, cursor->dir->entries.size());
+
+    // Size the page without building it
+    size_t contentLength = append_listing_prologue(nullptr, *cursor) + append_listing_epilogue(nullptr, *cursor);
+    for(size_t i = cursor->offset; i < cursor->end; i++) contentLength += append_listing_entry(nullptr, *cursor, i);
+
+    Response response;
+    build_head(response.head, 200, contentLength, cursor->json ? "application/json" : "text/html");
+    response.listing = cursor;
+    return response;
+}
+
+// Counters of every worker, summed, in the Prometheus text format.
+std::string metrics_text(){
+    uint64_t statusTotals[STATUS_COUNT + 1] = {};
+    uint64_t bytesSent = 0, cacheHits = 0, cacheMisses = 0;
+    int64_t activeConnections = 0;
+    uint64_t buckets[STAGE_COUNT][STAGE_BUCKETS] = {}, counts[STAGE_COUNT] = {}, sums[STAGE_COUNT] = {};
+    for(int w = 0; w < allWorkerCount; w++){
+        WorkerStats& stats = allWorkerStats[w];
+        for(int i = 0; i <= STATUS_COUNT; i++) statusTotals[i] += stats.statusCounts[i].load(std::memory_order_relaxed);
+        bytesSent += stats.bytesSent.load(std::memory_order_relaxed);
+        cacheHits += stats.cacheHits.load(std::memory_order_relaxed);
+        cacheMisses += stats.cacheMisses.load(std::memory_order_relaxed);
+        activeConnections += stats.activeConnections.load(std::memory_order_relaxed);
+        for(int stage = 0; stage < STAGE_COUNT; stage++){
+            for(int b = 0; b < STAGE_BUCKETS; b++) buckets[stage][b] += stats.stages[stage].buckets[b].load(std::memory_order_relaxed);
+            counts[stage] += stats.stages[stage].count.load(std::memory_order_relaxed);
+            sums[stage] += stats.stages[stage].sumNs.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::ostringstream out;
+    out<<"# HELP http_requests_total Responses by status code.\n# TYPE http_requests_total counter\n";
+    for(int i = 0; i < STATUS_COUNT; i++) out<<"http_requests_total{code=\""<<statusLines[i].code<<"\"} "<<statusTotals[i]<<"\n";
+    out<<"http_requests_total{code=\"other\"} "<<statusTotals[STATUS_COUNT]<<"\n";
+    out<<"# HELP http_response_bytes_total Bytes handed to the kernel for responses.\n# TYPE http_response_bytes_total counter\n";
+    out<<"http_response_bytes_total "<<bytesSent<<"\n";
+    out<<"# HELP http_active_connections Open client connections.\n# TYPE http_active_connections gauge\n";
+    out<<"http_active_connections "<<activeConnections<<"\n";
+    out<<"# HELP file_cache_hits_total Hot-file cache lookups that hit.\n# TYPE file_cache_hits_total counter\n";
+    out<<"file_cache_hits_total "<<cacheHits<<"\n";
+    out<<"# HELP file_cache_misses_total Hot-file cache lookups that missed.\n# TYPE file_cache_misses_total counter\n";
+    out<<"file_cache_misses_total "<<cacheMisses<<"\n";
+    out<<"# HELP file_cache_hit_ratio Share of lookups served from the cache.\n# TYPE file_cache_hit_ratio gauge\n";
+    out<<"file_cache_hit_ratio "<<(cacheHits + cacheMisses ? (double)cacheHits / (cacheHits + cacheMisses) : 0)<<"\n";
+    if(mmapFiles){
+        std::lock_guard<std::mutex> guard(mappingCache.lock);
+        out<<"# HELP mmap_cache_hits_total Mapping cache lookups that hit.\n# TYPE mmap_cache_hits_total counter\n";
+        out<<"mmap_cache_hits_total "<<mappingCache.hits<<"\n";
+        out<<"# HELP mmap_cache_misses_total Mapping cache lookups that missed.\n# TYPE mmap_cache_misses_total counter\n";
+        out<<"mmap_cache_misses_total "<<mappingCache.misses<<"\n";
+        out<<"# HELP mmap_cache_bytes Bytes of files currently mapped by the cache.\n# TYPE mmap_cache_bytes gauge\n";
+        out<<"mmap_cache_bytes "<<mappingCache.bytes<<"\n";
+    }
+    out<<"# HELP http_stage_duration_seconds Time spent per request in each stage.\n# TYPE http_stage_duration_seconds histogram\n";
+    for(int stage = 0; stage < STAGE_COUNT; stage++){
+        uint64_t cumulative = 0;
+        for(int b = 0; b < STAGE_BUCKETS; b++){
+            cumulative += buckets[stage][b];
+            out<<"http_stage_duration_seconds_bucket{stage=\""<<stageNames[stage]<<"\",le=\"";
+            if(b < STAGE_BUCKETS - 1) out<<stageBucketBounds[b] / 1e6;
+            else out<<"+Inf";
+            out<<"\"} "<<cumulative<<"\n";
+        }
+        out<<"http_stage_duration_seconds_sum{stage=\""<<stageNames[stage]<<"\"} "<<sums[stage] / 1e9<<"\n";
+        out<<"http_stage_duration_seconds_count{stage=\""<<stageNames[stage]<<"\"} "<<counts[stage]<<"\n";
+    }
+    out<<"# HELP http_worker_requests_total Requests routed by each worker.\n# TYPE http_worker_requests_total counter\n";
+    for(int w = 0; w < allWorkerCount; w++){
+        out<<"http_worker_requests_total{worker=\""<<w<<"\"} "<<allWorkerStats[w].requests.load(std::memory_order_relaxed)<<"\n";
+    }
+    return out.str();
+}
+
+// Turn one parsed request into a Response. Shared by both engines.
+// A path the server may serve: absolute, and with no ".." segment that
+// could climb out of the served directory.
+bool safe_path(std::string_view path){
+    if(path.empty() || path[0] != '/') return false;
+    size_t start = 1;
+    while(start <= path.size()){
+        size_t end = path.find('/', start);
+        if(end == std::string_view::npos) end = path.size();
+        if(path.substr(start, end - start) == "..") return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+Response route_request(const HttpRequest& request, const std::string& directory, const std::string& clientIp){
+    bump<uint64_t>(workerStats->requests);
+    if(request.method != "GET"){
+        log_request(clientIp, request.requestLine, 405);
+        return build_response(405, "<h1>405 Method Not Allowed</h1>", "text/html");
+    }
+
+    // The query string only matters to directory listings
+    size_t queryStart = request.target.find('?');
+    std::string_view requestPath = request.target.substr(0, queryStart);
+    std::string_view query = queryStart == std::string_view::npos ? std::string_view() : request.target.substr(queryStart + 1);
+    if(requestPath == STATS_PATH){
+        log_request(clientIp, request.requestLine, 200);
+        return build_response(200, metrics_text(), "text/plain; version=0.0.4");
+    }
+    // Checked before the path reaches the cache, stat() or a mapping
+    if(!safe_path(requestPath)){
+        log_request(clientIp, request.requestLine, 400);
+        return build_response(400, "<h1>400 Bad Request</h1>", "text/html");
+    }
+    std::string fullPath = directory+std::string(requestPath);
+    std::string cacheKey = fullPath+"\n"+encoding_flags(request.header("Accept-Encoding"));
+    Response response;
+    if(request.header("Range").empty()){
+        response.cached = cache_lookup(cacheKey);
+        bump<uint64_t>(response.cached ? workerStats->cacheHits : workerStats->cacheMisses);
+    }
+    if(response.cached){
+        if(not_modified(request, response.cached->etag, response.cached->mtime.tv_sec)){
+            log_request(clientIp, request.requestLine, 304);
+            return not_modified_response(response.cached->etag, response.cached->mtime.tv_sec);
+        }
+        log_request(clientIp, request.requestLine, 200);
+        return response;
+    }
+
+    struct stat fileStat;
+    uint64_t statStart = now_ns();
+    int statResult = stat(fullPath.c_str(), &fileStat);
+    record_stage(STAGE_STAT, statStart);
+    if(statResult==0){
+        int statusCode = 200;
+        uint64_t readStart = now_ns();
+        if(S_ISDIR(fileStat.st_mode)){
+            response = directory_listing_response(fullPath, fileStat, requestPath, query);
+        }
+        else{
+            response = file_response(fullPath, request, cacheKey, statusCode);
+        }
+        record_stage(STAGE_READ, readStart);
+        log_request(clientIp, request.requestLine, statusCode);
+        return response;
+    }
+    log_request(clientIp, request.requestLine, 404);
+    return build_response(404, "<h1>404 Not Found</h1>", "text/html");
+}
+
+// ---------------------------------------------------------------------------
+// Serial engine: the original accept -> recv -> respond -> close loop. It
+// answers one request per connection (with "Connection: close") on purpose,
+// since holding a keep-alive socket here would block every other client.
+// ---------------------------------------------------------------------------
+
+void handle_request(int acceptSocket, const std::string& directory, const std::string& clientIp){
+    // Keep reading until the head is complete, however it is split into segments.
+    // SO_RCVTIMEO bounds each recv; the deadline bounds the whole head, so a
+    // client trickling a byte at a time cannot hold the worker indefinitely.
+    std::string in;
+    HttpParser parser(MAX_REQUEST_SIZE);
+    HttpRequest request;
+    char buffer[BUFFER_SIZE];
+    HttpParseResult result = HTTP_PARSE_INCOMPLETE;
+    uint64_t deadline = now_ns() + (uint64_t)headerTimeout * 1000000000ull;
+    while(result == HTTP_PARSE_INCOMPLETE){
+        int byteCount = recv(acceptSocket, buffer, BUFFER_SIZE, 0);
+        if(byteCount < 0 && errno == EINTR) continue;
+        if(byteCount <= 0 || now_ns() > deadline) return;
+        in.append(buffer, byteCount);
+        uint64_t parseStart = now_ns();
+        result = parser.parse(in.data(), in.size(), request);
+        if(result != HTTP_PARSE_INCOMPLETE) record_stage(STAGE_PARSE, parseStart);
+    }
+
+    Response response;
+    if(result == HTTP_PARSE_ERROR){
+        count_status(400);
+        response = build_response(400, "<h1>400 Bad Request</h1>", "text/html");
+    }
+    else{
+        process_cache_invalidations();
+        response = route_request(request, directory, clientIp);
+    }
+    finish_head(response, false);
+    pump_response(acceptSocket, response);
+    release_response(response);
+}
+
+void run_serial_loop(int serverSocket, const std::string& directory){
+    while(1){
+        sockaddr_in clientAddress;
+        socklen_t addressLength = sizeof(clientAddress);
+        int acceptSocket = accept(serverSocket, (sockaddr*)&clientAddress, &addressLength);
+        if(acceptSocket == INVALID_SOCKET){
+            std::cout<<"accept() failed: "<<strerror(errno)<<"\n";
+            continue;
+        }
+
+        // Blocking sockets here, so the deadlines are socket timeouts
+        timeval receiveTimeout{headerTimeout, 0}, sendTimeout{writeTimeout, 0};
+        setsockopt(acceptSocket, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+        setsockopt(acceptSocket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+        bump<int64_t>(workerStats->activeConnections, 1);
+        handle_request(acceptSocket, directory, inet_ntoa(clientAddress.sin_addr));
+        close(acceptSocket);
+        bump<int64_t>(workerStats->activeConnections, -1);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Epoll engine: every socket is non-blocking and registered edge-triggered,
+// so each readiness edge must be drained until EAGAIN. Bytes accumulate in
+// `in` until a full request head ("\r\n\r\n") has arrived, however many reads
+// that takes. Connections are persistent: pipelined requests are routed in
+// arrival order and their responses queued in `out`, which is flushed front
+// to back so responses leave in the same order on the same socket.
+// ---------------------------------------------------------------------------
+
+struct Connection {
+    int fd;
+    std::string clientIp;
+    std::string in;              // read buffer; bytes before inStart are consumed
+    size_t inStart = 0;
+    HttpParser parser{MAX_REQUEST_SIZE};
+    std::deque<Response> out;
+    int requestCount = 0;
+    bool closeAfterOut = false;  // last response queued, close once it is sent
+    bool peerClosed = false;     // client shut down its sending side
+    bool readBlocked = false;    // stopped reading before EAGAIN, resume later
+    uint32_t peerAddress = 0;    // counted against the per-IP cap
+    TimerNode timer;             // the one deadline the connection is currently under
+    int timerRequestCount = 0;   // requestCount when the timer was armed
+};
+
+thread_local std::unordered_map<int, Connection> connections;
+
+// ---------------------------------------------------------------------------
+// Deadlines and the per-IP cap, shared by the epoll and io_uring engines.
+// Every connection is under exactly one deadline, kept in a per-worker
+// timing wheel with 100 ms ticks:
+//   header - a request head must be complete within --header-timeout of its
+//            first byte (or of the accept), however slowly it trickles in;
+//   write  - a queued response must make progress every --write-timeout;
+//   idle   - a kept-alive connection with nothing pending is closed after
+//            --keepalive-timeout.
+// ---------------------------------------------------------------------------
+
+#define WHEEL_TICK_MS 100
+#define IP_TABLE_SIZE 65536          // power of two
+
+enum ConnectionTimer {
+    TIMER_HEADER = 1,
+    TIMER_WRITE,
+    TIMER_IDLE
+};
+
+thread_local TimerWheel timerWheel;
+
+// Open connections per client address, shared by all workers. Addresses
+// are hashed into a fixed table; two addresses that share a slot share a
+// budget, which can only make the cap stricter, never looser.
+std::atomic<uint32_t> ipConnectionCounts[IP_TABLE_SIZE];
+
+const char tooManyConnections[] = "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+uint64_t current_tick(){
+    return now_ns() / (WHEEL_TICK_MS * 1000000ull);
+}
+
+// Re-arm the connection's deadline after it has been serviced. A header
+// deadline is kept while the same head is still arriving; a write deadline
+// is pushed back only when bytes went out; an idle deadline restarts on
+// any activity.
+void update_timer(Connection& conn, bool progressed){
+    int kind = TIMER_IDLE;
+    int seconds = keepAliveTimeout;
+    if(!conn.out.empty()){
+        kind = TIMER_WRITE;
+        seconds = writeTimeout;
+    }
+    else if(conn.inStart < conn.in.size() || conn.requestCount == 0){
+        kind = TIMER_HEADER;
+        seconds = headerTimeout;
+    }
+
+    if(conn.timer.armed() && conn.timer.kind == kind){
+        if(kind == TIMER_HEADER && conn.timerRequestCount == conn.requestCount) return;
+        if(kind == TIMER_WRITE && !progressed) return;
+    }
+    conn.timer.kind = kind;
+    conn.timerRequestCount = conn.requestCount;
+    timerWheel.schedule(conn.timer, current_tick() + (uint64_t)seconds * 1000 / WHEEL_TICK_MS);
+}
+
+std::atomic<uint32_t>& address_slot(uint32_t address){
+    return ipConnectionCounts[(address * 2654435761u) >> 16 & (IP_TABLE_SIZE - 1)];
+}
+
+// Count a new connection from `address`; false if that would exceed the cap.
+bool admit_address(uint32_t address){
+    if(maxConnectionsPerIp <= 0) return true;
+    std::atomic<uint32_t>& slot = address_slot(address);
+    if(slot.fetch_add(1, std::memory_order_relaxed) >= (uint32_t)maxConnectionsPerIp){
+        slot.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+void release_address(uint32_t address){
+    if(maxConnectionsPerIp > 0) address_slot(address).fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Best-effort 429 on a connection over the cap, then close it.
+void reject_connection(int fd){
+    send(fd, tooManyConnections, sizeof(tooManyConnections) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    count_status(429);
+}
+
+bool set_nonblocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) return false;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+void close_connection(int epollFd, int fd){
+    auto it = connections.find(fd);
+    if(it != connections.end()){
+        for(Response& response : it->second.out) release_response(response);
+        timerWheel.cancel(it->second.timer);
+        release_address(it->second.peerAddress);
+        bump<int64_t>(workerStats->activeConnections, -1);
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    connections.erase(fd);
+}
+
+// Read until EAGAIN, or until a full request's worth is buffered so a
+// pipelining client cannot make us buffer without bound.
+// Returns false once the connection has been closed.
+bool read_available(int epollFd, Connection& conn){
+    char buffer[READ_CHUNK_SIZE];
+    conn.readBlocked = false;
+    // Drop consumed requests; the parser's progress is relative to inStart
+    if(conn.inStart > 0){
+        conn.in.erase(0, conn.inStart);
+        conn.inStart = 0;
+    }
+    while(!conn.peerClosed){
+        if(conn.in.size() >= MAX_REQUEST_SIZE){
+            conn.readBlocked = true;
+            break;
+        }
+        ssize_t byteCount = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if(byteCount < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            close_connection(epollFd, conn.fd);
+            return false;
+        }
+        if(byteCount == 0){
+            conn.peerClosed = true;
+            break;
+        }
+        conn.in.append(buffer, byteCount);
+    }
+    return true;
+}
+
+// Route every complete buffered request, queueing the responses in order.
+// Returns true if it stopped at MAX_PIPELINE with requests possibly left.
+bool queue_requests(Connection& conn, const std::string& directory){
+    while(!conn.closeAfterOut){
+        if(conn.out.size() >= MAX_PIPELINE) return true;
+        HttpRequest request;
+        uint64_t parseStart = now_ns();
+        HttpParseResult result = conn.parser.parse(conn.in.data() + conn.inStart, conn.in.size() - conn.inStart, request);
+        if(result == HTTP_PARSE_INCOMPLETE) break;
+        record_stage(STAGE_PARSE, parseStart);
+        if(result == HTTP_PARSE_ERROR){
+            count_status(400);
+            Response response = build_response(400, "<h1>400 Bad Request</h1>", "text/html");
+            finish_head(response, false);
+            conn.out.push_back(std::move(response));
+            conn.closeAfterOut = true;
+            break;
+        }
+
+        conn.requestCount++;
+        bool keepAlive = request.keep_alive() && conn.requestCount < maxKeepAliveRequests;
+        Response response = route_request(request, directory, conn.clientIp);
+        conn.inStart += request.totalLength;
+        finish_head(response, keepAlive);
+        conn.out.push_back(std::move(response));
+        if(!keepAlive) conn.closeAfterOut = true;
+    }
+    return false;
+}
+
+// Route every complete buffered request, then flush queued responses in
+// order. Returns false once the connection has been closed.
+bool service_connection(int epollFd, Connection& conn, const std::string& directory){
+    while(1){
+        bool morePipelined = queue_requests(conn, directory);
+
+        while(!conn.out.empty()){
+            int result = pump_response(conn.fd, conn.out.front());
+            if(result < 0){
+                close_connection(epollFd, conn.fd);
+                return false;
+            }
+            if(result == 0) return true;  // wait for EPOLLOUT
+            conn.out.pop_front();
+        }
+
+        // Requests past MAX_PIPELINE are already buffered; no read will announce them
+        if(morePipelined) continue;
+        if(conn.closeAfterOut || conn.peerClosed){
+            close_connection(epollFd, conn.fd);
+            return false;
+        }
+        if(!conn.readBlocked) return true;
+        if(!read_available(epollFd, conn)) return false;
+    }
+}
+
+void accept_connections(int epollFd, int serverSocket){
+    while(1){
+        sockaddr_in clientAddress;
+        socklen_t addressLength = sizeof(clientAddress);
+        int acceptSocket = accept4(serverSocket, (sockaddr*)&clientAddress, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(acceptSocket == INVALID_SOCKET){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                std::cout<<"accept() failed: "<<strerror(errno)<<"\n";
+            }
+            return;
+        }
+
+        uint32_t peerAddress = ntohl(clientAddress.sin_addr.s_addr);
+        if(!admit_address(peerAddress)){
+            reject_connection(acceptSocket);
+            continue;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.fd = acceptSocket;
+        if(epoll_ctl(epollFd, EPOLL_CTL_ADD, acceptSocket, &event) < 0){
+            release_address(peerAddress);
+            close(acceptSocket);
+            continue;
+        }
+
+        Connection& conn = connections[acceptSocket];
+        conn.fd = acceptSocket;
+        conn.clientIp = inet_ntoa(clientAddress.sin_addr);
+        conn.peerAddress = peerAddress;
+        conn.timer.owner = acceptSocket;
+        update_timer(conn, false);
+        bump<int64_t>(workerStats->activeConnections, 1);
+    }
+}
+
+void run_epoll_loop(int serverSocket, const std::string& directory){
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollFd < 0){
+        std::cout<<"epoll_create1() failed: "<<strerror(errno)<<"\n";
+        return;
+    }
+
+    set_nonblocking(serverSocket);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = serverSocket;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &event);
+    if(inotifyFd >= 0){
+        event.data.fd = inotifyFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, inotifyFd, &event);
+    }
+
+    timerWheel.now = current_tick();
+    epoll_event events[MAX_EVENTS];
+    while(1){
+        int readyCount = epoll_wait(epollFd, events, MAX_EVENTS, WHEEL_TICK_MS);
+        if(readyCount < 0){
+            if(errno == EINTR) continue;
+            std::cout<<"epoll_wait() failed: "<<strerror(errno)<<"\n";
+            break;
+        }
+
+        // Apply cache invalidations before serving anything from this batch
+        for(int i = 0; i < readyCount; i++){
+            if(events[i].data.fd == inotifyFd) process_cache_invalidations();
+        }
+
+        for(int i = 0; i < readyCount; i++){
+            int fd = events[i].data.fd;
+            if(fd == serverSocket){
+                accept_connections(epollFd, serverSocket);
+                continue;
+            }
+            if(fd == inotifyFd) continue;
+
+            auto it = connections.find(fd);
+            if(it == connections.end()) continue;
+            Connection& conn = it->second;
+            uint32_t ready = events[i].events;
+
+            if(ready & EPOLLERR){
+                close_connection(epollFd, fd);
+                continue;
+            }
+            // The worker's byte counter tells whether this connection sent anything
+            uint64_t sentBefore = workerStats->bytesSent.load(std::memory_order_relaxed);
+            if(ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)){
+                if(!read_available(epollFd, conn)) continue;
+            }
+            if(!service_connection(epollFd, conn, directory)) continue;
+            update_timer(conn, workerStats->bytesSent.load(std::memory_order_relaxed) != sentBefore);
+        }
+        timerWheel.advance(current_tick(), [&](TimerNode& timer){
+            close_connection(epollFd, (int)timer.owner);
+        });
+    }
+    close(epollFd);
+}
+
+// ---------------------------------------------------------------------------
+// io_uring engine: accepts, reads and sends are queued as submission entries
+// and the whole batch goes to the kernel in one io_uring_enter() per loop,
+// which also waits for the next completions. A single multishot accept keeps
+// producing connections without being re-armed; reads land in buffers
+// registered with the ring up front; file bodies move file -> pipe -> socket
+// as a linked pair of splice operations, so they never enter user space.
+// Routing, caching and response building are shared with the other engines.
+// liburing is not required: the ring is driven through the raw syscalls.
+// ---------------------------------------------------------------------------
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 256       // registered read buffers of READ_CHUNK_SIZE
+#define URING_SPLICE_CHUNK 65536     // default pipe capacity
+
+enum UringOp {
+    URING_OP_ACCEPT = 1,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_SPLICE_IN,              // file -> pipe
+    URING_OP_SPLICE_OUT,             // pipe -> socket
+    URING_OP_POLL_OUT,               // the socket was full; wait to splice again
+    URING_OP_TIMER,
+    URING_OP_INOTIFY
+};
+
+struct Uring {
+    int fd = -1;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned sqEntries;
+    io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    unsigned localTail = 0;          // entries filled in, published on submit
+    unsigned submittedTail = 0;
+};
+
+struct UringConnection : Connection {
+    uint32_t id = 0;
+    int inflight = 0;                // operations the kernel still owns
+    bool readPosted = false;
+    bool sendPosted = false;         // a send, or a splice pair, is in flight
+    bool spliceFailed = false;
+    bool closing = false;
+    int bufferIndex = -1;            // registered buffer of the posted read
+    std::unique_ptr<char[]> fallbackBuffer;   // used when every registered buffer is taken
+    int pipeFds[2] = {-1, -1};
+    size_t pipeFill = 0;             // bytes spliced into the pipe, not yet out
+    iovec iov[3];                    // must outlive the posted sendmsg
+    msghdr message{};
+    size_t* sendCounter = nullptr;   // progress counter the posted sendmsg advances
+};
+
+thread_local Uring ring;
+thread_local std::unordered_map<uint32_t, UringConnection> uringConnections;
+thread_local uint32_t nextConnectionId = 1;
+thread_local std::vector<char> registeredMemory;
+thread_local std::vector<int> freeBuffers;
+thread_local bool buffersRegistered = false;
+thread_local __kernel_timespec timerInterval;
+
+uint64_t uring_tag(uint32_t id, UringOp op){
+    return ((uint64_t)id << 8) | op;
+}
+
+bool uring_init(Uring& r, unsigned entries){
+    io_uring_params params{};
+    r.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(r.fd < 0) return false;
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(singleMap) sqSize = cqSize = std::max(sqSize, cqSize);
+
+    char* sq = (char*)mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED) return false;
+    char* cq = sq;
+    if(!singleMap){
+        cq = (char*)mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_CQ_RING);
+        if(cq == MAP_FAILED) return false;
+    }
+    r.sqes = (io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r.fd, IORING_OFF_SQES);
+    if(r.sqes == MAP_FAILED) return false;
+
+    r.sqHead = (unsigned*)(sq + params.sq_off.head);
+    r.sqTail = (unsigned*)(sq + params.sq_off.tail);
+    r.sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r.sqArray = (unsigned*)(sq + params.sq_off.array);
+    r.sqEntries = params.sq_entries;
+    r.cqHead = (unsigned*)(cq + params.cq_off.head);
+    r.cqTail = (unsigned*)(cq + params.cq_off.tail);
+    r.cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r.cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    r.localTail = r.submittedTail = *r.sqTail;
+    return true;
+}
+
+// Hand every filled entry to the kernel, optionally waiting for completions.
+int uring_submit(Uring& r, unsigned waitCount){
+    __atomic_store_n(r.sqTail, r.localTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = r.localTail - r.submittedTail;
+    int result = syscall(__NR_io_uring_enter, r.fd, toSubmit, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if(result > 0) r.submittedTail += result;
+    return result;
+}
+
+// Make room for `count` more entries, submitting what is queued if the ring
+// is full. Fails only if the kernel refuses the submission.
+bool uring_reserve(Uring& r, unsigned count){
+    while(r.localTail - __atomic_load_n(r.sqHead, __ATOMIC_ACQUIRE) + count > r.sqEntries){
+        if(uring_submit(r, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return false;
+    }
+    return true;
+}
+
+// The next free entry, zeroed, or nullptr if no room can be made.
+io_uring_sqe* uring_get_sqe(Uring& r){
+    if(!uring_reserve(r, 1)) return nullptr;
+    unsigned index = r.localTail & *r.sqMask;
+    io_uring_sqe* sqe = &r.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r.sqArray[index] = index;
+    r.localTail++;
+    return sqe;
+}
+
+// The post functions below return false if the entry could not be queued.
+// Sockets are non-blocking, so a full socket is waited for with a poll
+// instead of tying up an io-wq thread.
+bool uring_post_accept(int serverSocket){
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = serverSocket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = uring_tag(0, URING_OP_ACCEPT);
+    return true;
+}
+
+bool uring_post_timer(){
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)&timerInterval;
+    sqe->len = 1;
+    sqe->user_data = uring_tag(0, URING_OP_TIMER);
+    return true;
+}
+
+bool uring_post_inotify(){
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = inotifyFd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = uring_tag(0, URING_OP_INOTIFY);
+    return true;
+}
+
+// One pool of read buffers per worker, registered so the kernel does not
+// have to pin and map the destination pages on every read.
+void uring_register_buffers(){
+    registeredMemory.resize((size_t)URING_BUFFER_COUNT * READ_CHUNK_SIZE);
+    std::vector<iovec> iovecs(URING_BUFFER_COUNT);
+    for(int i = 0; i < URING_BUFFER_COUNT; i++){
+        iovecs[i].iov_base = registeredMemory.data() + (size_t)i * READ_CHUNK_SIZE;
+        iovecs[i].iov_len = READ_CHUNK_SIZE;
+    }
+    if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs.data(), URING_BUFFER_COUNT) < 0){
+        std::cout<<"io_uring buffer registration failed, reading into plain buffers: "<<strerror(errno)<<"\n";
+        registeredMemory.clear();
+        return;
+    }
+    buffersRegistered = true;
+    for(int i = URING_BUFFER_COUNT - 1; i >= 0; i--) freeBuffers.push_back(i);
+}
+
+bool uring_post_read(UringConnection& conn){
+    if(conn.readPosted || conn.closing || conn.peerClosed) return true;
+    if(conn.inStart > 0){
+        conn.in.erase(0, conn.inStart);
+        conn.inStart = 0;
+    }
+    if(conn.in.size() >= MAX_REQUEST_SIZE) return true;   // resumed once requests are consumed
+
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->fd = conn.fd;
+    sqe->len = READ_CHUNK_SIZE;
+    if(buffersRegistered && !freeBuffers.empty()){
+        conn.bufferIndex = freeBuffers.back();
+        freeBuffers.pop_back();
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uint64_t)(registeredMemory.data() + (size_t)conn.bufferIndex * READ_CHUNK_SIZE);
+        sqe->buf_index = conn.bufferIndex;
+    }
+    else{
+        if(!conn.fallbackBuffer) conn.fallbackBuffer.reset(new char[READ_CHUNK_SIZE]);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (uint64_t)conn.fallbackBuffer.get();
+    }
+    sqe->user_data = uring_tag(conn.id, URING_OP_READ);
+    conn.readPosted = true;
+    conn.inflight++;
+    return true;
+}
+
+// The caller has reserved the entry, so that a linked pair is queued whole
+bool uring_post_splice(int fdIn, int64_t offsetIn, int fdOut, unsigned length, uint8_t flags, uint64_t tag){
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fdOut;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = fdIn;
+    sqe->splice_off_in = (uint64_t)offsetIn;
+    sqe->len = length;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    sqe->flags = flags;
+    sqe->user_data = tag;
+    return true;
+}
+
+bool uring_post_poll_out(UringConnection& conn){
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn.fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = uring_tag(conn.id, URING_OP_POLL_OUT);
+    conn.sendPosted = true;
+    conn.inflight++;
+    return true;
+}
+
+bool uring_post_sendmsg(UringConnection& conn, int iovCount, bool more, size_t* counter){
+    conn.sendCounter = counter;
+    conn.message = msghdr{};
+    conn.message.msg_iov = conn.iov;
+    conn.message.msg_iovlen = iovCount;
+    io_uring_sqe* sqe = uring_get_sqe(ring);
+    if(!sqe) return false;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn.fd;
+    sqe->addr = (uint64_t)&conn.message;
+    sqe->msg_flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    sqe->user_data = uring_tag(conn.id, URING_OP_SEND);
+    conn.sendPosted = true;
+    conn.inflight++;
+    return true;
+}
+
+// Queue the next piece of the front response: memory parts, then each
+// range's multipart prefix and file bytes, then the trailer. Finished
+// responses are popped. Returns false if the connection cannot continue.
+bool uring_post_send(UringConnection& conn){
+    while(!conn.out.empty()){
+        Response& response = conn.out.front();
+        bool rangesLeft = response.rangeIndex < response.ranges.size();
+        int iovCount = response_iovecs(response, conn.iov);
+        if(iovCount > 0){
+            return uring_post_sendmsg(conn, iovCount, rangesLeft, &response.memorySent);
+        }
+        while(response.rangeIndex < response.ranges.size()){
+            FileRange& range = response.ranges[response.rangeIndex];
+            if(response.prefixSent < range.prefix.size()){
+                conn.iov[0].iov_base = (void*)(range.prefix.data() + response.prefixSent);
+                conn.iov[0].iov_len = range.prefix.size() - response.prefixSent;
+                return uring_post_sendmsg(conn, 1, true, &response.prefixSent);
+            }
+            if(response.mapping){
+                if(range.mappedSent < range.length){
+                    conn.iov[0].iov_base = (void*)(mapping_data(*response.mapping) + range.offset + range.mappedSent);
+                    conn.iov[0].iov_len = range.length - range.mappedSent;
+                    return uring_post_sendmsg(conn, 1, !last_file_part(response), &range.mappedSent);
+                }
+                range.length = 0;
+            }
+            if(conn.pipeFill > 0){
+                // Left over from a short socket write; drain before reading more file
+                if(!uring_post_splice(conn.pipeFds[0], -1, conn.fd, conn.pipeFill, 0, uring_tag(conn.id, URING_OP_SPLICE_OUT))) return false;
+                conn.sendPosted = true;
+                conn.inflight++;
+                return true;
+            }
+            if(range.length > 0){
+                if(conn.pipeFds[0] < 0 && pipe2(conn.pipeFds, O_CLOEXEC) < 0) return false;
+                unsigned chunk = (unsigned)std::min<off_t>(range.length, URING_SPLICE_CHUNK);
+                if(!uring_reserve(ring, 2)) return false;
+                uring_post_splice(response.fileFd, range.offset, conn.pipeFds[1], chunk, IOSQE_IO_LINK, uring_tag(conn.id, URING_OP_SPLICE_IN));
+                uring_post_splice(conn.pipeFds[0], -1, conn.fd, chunk, 0, uring_tag(conn.id, URING_OP_SPLICE_OUT));
+                conn.sendPosted = true;
+                conn.inflight += 2;
+                return true;
+            }
+            response.rangeIndex++;
+            response.prefixSent = 0;
+        }
+        if(response.trailerSent < response.trailer.size()){
+            conn.iov[0].iov_base = (void*)(response.trailer.data() + response.trailerSent);
+            conn.iov[0].iov_len = response.trailer.size() - response.trailerSent;
+            return uring_post_sendmsg(conn, 1, false, &response.trailerSent);
+        }
+        release_response(response);
+        record_stage(STAGE_SEND, response.queuedNs);
+        conn.out.pop_front();
+    }
+    return true;
+}
+
+void uring_release_buffer(UringConnection& conn){
+    if(conn.bufferIndex >= 0){
+        freeBuffers.push_back(conn.bufferIndex);
+        conn.bufferIndex = -1;
+    }
+}
+
+// Closing waits for the kernel to give back every buffer it still holds;
+// shutdown() makes pending reads and sends complete promptly.
+void uring_close(UringConnection& conn){
+    if(!conn.closing){
+        conn.closing = true;
+        timerWheel.cancel(conn.timer);
+        release_address(conn.peerAddress);
+        if(conn.inflight > 0) shutdown(conn.fd, SHUT_RDWR);
+    }
+    if(conn.inflight > 0) return;
+
+    for(Response& response : conn.out) release_response(response);
+    uring_release_buffer(conn);
+    if(conn.pipeFds[0] >= 0){
+        close(conn.pipeFds[0]);
+        close(conn.pipeFds[1]);
+    }
+    close(conn.fd);
+    bump<int64_t>(workerStats->activeConnections, -1);
+    uringConnections.erase(conn.id);
+}
+
+void uring_service(UringConnection& conn, const std::string& directory){
+    if(conn.closing){
+        uring_close(conn);
+        return;
+    }
+    queue_requests(conn, directory);
+    if(!conn.sendPosted){
+        if(!uring_post_send(conn)){
+            uring_close(conn);
+            return;
+        }
+        if(!conn.sendPosted && (conn.closeAfterOut || conn.peerClosed)){
+            uring_close(conn);
+            return;
+        }
+    }
+    if(!uring_post_read(conn)) uring_close(conn);
+}
+
+void uring_complete(const io_uring_cqe& cqe, int serverSocket, const std::string& directory){
+    uint32_t id = cqe.user_data >> 8;
+    UringOp op = (UringOp)(cqe.user_data & 0xff);
+    int result = cqe.res;
+
+    if(op == URING_OP_ACCEPT){
+        if(result >= 0){
+            sockaddr_in clientAddress{};
+            socklen_t addressLength = sizeof(clientAddress);
+            getpeername(result, (sockaddr*)&clientAddress, &addressLength);
+            uint32_t peerAddress = ntohl(clientAddress.sin_addr.s_addr);
+            if(!admit_address(peerAddress)){
+                reject_connection(result);
+            }
+            else{
+                uint32_t newId = nextConnectionId++;
+                if(nextConnectionId == 0) nextConnectionId = 1;
+                UringConnection& conn = uringConnections[newId];
+                conn.id = newId;
+                conn.fd = result;
+                conn.clientIp = inet_ntoa(clientAddress.sin_addr);
+                conn.peerAddress = peerAddress;
+                conn.timer.owner = newId;
+                update_timer(conn, false);
+                bump<int64_t>(workerStats->activeConnections, 1);
+                if(!uring_post_read(conn)) uring_close(conn);
+            }
+        }
+        else if(result != -EINTR){
+            std::cout<<"accept failed: "<<strerror(-result)<<"\n";
+        }
+        // The kernel drops a multishot accept after an error; re-arm it
+        if(!(cqe.flags & IORING_CQE_F_MORE) && !uring_post_accept(serverSocket)){
+            std::cout<<"io_uring: cannot re-arm accept: "<<strerror(errno)<<"\n";
+        }
+        return;
+    }
+    if(op == URING_OP_TIMER){
+        timerWheel.advance(current_tick(), [](TimerNode& timer){
+            auto expired = uringConnections.find((uint32_t)timer.owner);
+            if(expired != uringConnections.end()) uring_close(expired->second);
+        });
+        if(!uring_post_timer()) std::cout<<"io_uring: cannot re-arm the timer: "<<strerror(errno)<<"\n";
+        return;
+    }
+    if(op == URING_OP_INOTIFY){
+        process_cache_invalidations();
+        if(!uring_post_inotify()) std::cout<<"io_uring: cannot re-arm inotify: "<<strerror(errno)<<"\n";
+        return;
+    }
+
+    auto it = uringConnections.find(id);
+    if(it == uringConnections.end()) return;
+    UringConnection& conn = it->second;
+    conn.inflight--;
+
+    switch(op){
+    case URING_OP_READ:
+        conn.readPosted = false;
+        if(result > 0 && !conn.closing){
+            const char* data = conn.bufferIndex >= 0 ? registeredMemory.data() + (size_t)conn.bufferIndex * READ_CHUNK_SIZE : conn.fallbackBuffer.get();
+            conn.in.append(data, result);
+        }
+        else if(result == 0){
+            conn.peerClosed = true;
+        }
+        uring_release_buffer(conn);
+        if(result < 0 && result != -EINTR && result != -EAGAIN){
+            uring_close(conn);
+            return;
+        }
+        break;
+    case URING_OP_SEND:
+        conn.sendPosted = false;
+        if(result < 0){
+            uring_close(conn);
+            return;
+        }
+        *conn.sendCounter += result;
+        bump<uint64_t>(workerStats->bytesSent, result);
+        break;
+    case URING_OP_SPLICE_IN:
+        if(result <= 0){
+            conn.spliceFailed = true;   // read error, or the file shrank underneath us
+            break;
+        }
+        {
+            FileRange& range = conn.out.front().ranges[conn.out.front().rangeIndex];
+            range.offset += result;
+            range.length -= result;
+            conn.pipeFill += result;
+        }
+        break;
+    case URING_OP_SPLICE_OUT:
+        conn.sendPosted = false;
+        if(result == -EAGAIN && !conn.spliceFailed && !conn.closing){
+            // The socket is full; what reached the pipe waits there
+            if(!uring_post_poll_out(conn)) uring_close(conn);
+            return;
+        }
+        if(conn.spliceFailed || (result < 0 && result != -ECANCELED)){
+            uring_close(conn);
+            return;
+        }
+        // -ECANCELED just means the file read came up short and broke the link
+        if(result > 0){
+            conn.pipeFill -= result;
+            bump<uint64_t>(workerStats->bytesSent, result);
+        }
+        break;
+    case URING_OP_POLL_OUT:
+        conn.sendPosted = false;
+        if(result < 0){
+            uring_close(conn);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+    bool progressed = (op == URING_OP_SEND || op == URING_OP_SPLICE_OUT) && result > 0;
+    uring_service(conn, directory);
+    // Servicing may have closed and erased the connection
+    it = uringConnections.find(id);
+    if(it != uringConnections.end() && !it->second.closing) update_timer(it->second, progressed);
+}
+
+void run_uring_loop(int serverSocket, const std::string& directory){
+    if(!uring_init(ring, URING_ENTRIES)){
+        std::cout<<"io_uring unavailable ("<<strerror(errno)<<"), falling back to the epoll engine\n";
+        run_epoll_loop(serverSocket, directory);
+        return;
+    }
+    uring_register_buffers();
+
+    timerWheel.now = current_tick();
+    timerInterval.tv_sec = 0;
+    timerInterval.tv_nsec = WHEEL_TICK_MS * 1000000ll;
+    if(!uring_post_accept(serverSocket) || !uring_post_timer() || (inotifyFd >= 0 && !uring_post_inotify())){
+        std::cout<<"io_uring: cannot queue the first requests: "<<strerror(errno)<<"\n";
+        close(ring.fd);
+        return;
+    }
+
+    while(1){
+        if(uring_submit(ring, 1) < 0 && errno != EINTR && errno != EBUSY){
+            std::cout<<"io_uring_enter() failed: "<<strerror(errno)<<"\n";
+            break;
+        }
+        unsigned head = *ring.cqHead;
+        unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            io_uring_cqe cqe = ring.cqes[head & *ring.cqMask];
+            // Let the kernel reuse the slot before handlers queue more work
+            __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+            uring_complete(cqe, serverSocket, directory);
+        }
+    }
+    close(ring.fd);
+}
+
+// Tens of thousands of connections need more than the default 1024 fds.
+void raise_fd_limit(){
+    rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max){
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int create_listen_socket(int port, int backlog, bool reusePort){
+    int serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(serverSocket == INVALID_SOCKET){
+        std::cout<<"Error at socket(): "<<strerror(errno)<<"\n";
+        return INVALID_SOCKET;
+    }
+
+    int opt = 1;
+    setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if(reusePort && setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == SOCKET_ERROR){
+        std::cout<<"setsockopt(SO_REUSEPORT) failed: "<<strerror(errno)<<"\n";
+        close(serverSocket);
+        return INVALID_SOCKET;
+    }
+
+    sockaddr_in service{};
+    service.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &service.sin_addr.s_addr);
+    service.sin_port = htons(port);
+    if(bind(serverSocket, (sockaddr*)&service, sizeof(service)) == SOCKET_ERROR){
+        std::cout<<"bind() failed: "<<strerror(errno)<<"\n";
+        close(serverSocket);
+        return INVALID_SOCKET;
+    }
+
+    if(listen(serverSocket, backlog) == SOCKET_ERROR){
+        std::cout<<"listen(): Error listening on socket "<<strerror(errno)<<"\n";
+        close(serverSocket);
+        return INVALID_SOCKET;
+    }
+    return serverSocket;
+}
+
+void run_engine(const std::string& engine, int serverSocket, const std::string& directory){
+    if(engine == "serial"){
+        run_serial_loop(serverSocket, directory);
+    }
+    else if(engine == "uring"){
+        run_uring_loop(serverSocket, directory);
+    }
+    else{
+        run_epoll_loop(serverSocket, directory);
+    }
+}
+
+// Print per-worker request counts every `interval` seconds, with the
+// busiest/idlest ratio over the interval so imbalance stands out.
+void report_worker_stats(std::vector<WorkerStats>& stats, int interval){
+    std::vector<uint64_t> previous(stats.size(), 0);
+    while(1){
+        sleep(interval);
+        std::ostringstream report;
+        uint64_t busiest = 0, idlest = UINT64_MAX, total = 0;
+        report<<"Worker requests (last "<<interval<<"s):";
+        for(size_t i = 0; i < stats.size(); i++){
+            uint64_t current = stats[i].requests.load(std::memory_order_relaxed);
+            uint64_t delta = current - previous[i];
+            previous[i] = current;
+            busiest = std::max(busiest, delta);
+            idlest = std::min(idlest, delta);
+            total += delta;
+            report<<" ["<<i<<"] "<<delta;
+        }
+        if(total == 0) continue;
+        report<<" | total "<<total;
+        if(idlest > 0) report<<", imbalance "<<(double)busiest / idlest<<"x";
+        else report<<", imbalance: idle worker";
+        std::cout<<report.str()<<"\n"<<std::flush;
+    }
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 3){
+        std::cerr<<"Usage: "<<argv[0]<<" <port> <directory> [--engine serial|epoll|uring] [--keepalive-timeout <seconds>] [--max-requests <n>]\n"
+                 <<"       [--header-timeout <seconds>] [--write-timeout <seconds>] [--max-conns-per-ip <n>]\n"
+                 <<"       [--cache-size <MB>] [--cache-max-file <KB>] [--file-io sendfile|mmap] [--mmap-cache <MB>]\n"
+                 <<"       [--log-format legacy|common|json] [--log-file <path>] [--log-stdout]\n"
+                 <<"       [--workers <n>] [--pin-cpus] [--stats-interval <seconds>]\n";
+        return 1;
+    }
+
+    int port = std::stoi(argv[1]);
+    std::string directory = argv[2];
+    std::string engine = "epoll";
+    int workerCount = 1;
+    bool pinWorkers = false;
+    int statsInterval = 10;
+    for(int i = 3; i < argc; i++){
+        std::string arg = argv[i];
+        if(arg == "--engine" && i+1 < argc){
+            engine = argv[++i];
+        }
+        else if(arg == "--keepalive-timeout" && i+1 < argc){
+            keepAliveTimeout = std::stoi(argv[++i]);
+        }
+        else if(arg == "--max-requests" && i+1 < argc){
+            maxKeepAliveRequests = std::stoi(argv[++i]);
+        }
+        else if(arg == "--header-timeout" && i+1 < argc){
+            headerTimeout = std::stoi(argv[++i]);
+        }
+        else if(arg == "--write-timeout" && i+1 < argc){
+            writeTimeout = std::stoi(argv[++i]);
+        }
+        else if(arg == "--max-conns-per-ip" && i+1 < argc){
+            maxConnectionsPerIp = std::stoi(argv[++i]);
+        }
+        else if(arg == "--log-format" && i+1 < argc){
+            std::string format = argv[++i];
+            if(format == "legacy") logFormat = LOG_FORMAT_LEGACY;
+            else if(format == "common") logFormat = LOG_FORMAT_COMMON;
+            else if(format == "json") logFormat = LOG_FORMAT_JSON;
+            else{
+                std::cerr<<"Unknown log format: "<<format<<"\n";
+                return 1;
+            }
+        }
+        else if(arg == "--log-file" && i+1 < argc){
+            logPath = argv[++i];
+        }
+        else if(arg == "--log-stdout"){
+            logToStdout = true;
+        }
+        else if(arg == "--workers" && i+1 < argc){
+            workerCount = std::stoi(argv[++i]);
+        }
+        else if(arg == "--pin-cpus"){
+            pinWorkers = true;
+        }
+        else if(arg == "--stats-interval" && i+1 < argc){
+            statsInterval = std::stoi(argv[++i]);
+        }
+        else if(arg == "--cache-size" && i+1 < argc){
+            cacheCapacity = std::stoul(argv[++i]) * 1024 * 1024;
+        }
+        else if(arg == "--cache-max-file" && i+1 < argc){
+            cacheMaxFileSize = std::stoul(argv[++i]) * 1024;
+        }
+        else if(arg == "--file-io" && i+1 < argc){
+            std::string mode = argv[++i];
+            if(mode == "mmap") mmapFiles = true;
+            else if(mode != "sendfile"){
+                std::cerr<<"Unknown file I/O mode: "<<mode<<"\n";
+                return 1;
+            }
+        }
+        else if(arg == "--mmap-cache" && i+1 < argc){
+            mappingCapacity = std::stoul(argv[++i]) * 1024 * 1024;
+        }
+        else{
+            std::cerr<<"Unknown option: "<<arg<<"\n";
+            return 1;
+        }
+    }
+    if(engine != "serial" && engine != "epoll" && engine != "uring"){
+        std::cerr<<"Unknown engine: "<<engine<<"\n";
+        return 1;
+    }
+
+    if(workerCount < 1){
+        std::cerr<<"--workers must be at least 1\n";
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    start_access_log();
+
+    int backlog = engine == "serial" ? 1 : SOMAXCONN;
+    std::vector<WorkerStats> stats(workerCount);
+    allWorkerStats = stats.data();
+    allWorkerCount = workerCount;
+    if(workerCount == 1){
+        int serverSocket = create_listen_socket(port, backlog, false);
+        if(serverSocket == INVALID_SOCKET) return 0;
+        std::cout<<"Server started on port "<<port<<", serving files from "<<directory<<" ("<<engine<<" engine)\n";
+        workerStats = &stats[0];
+        init_file_cache();
+        run_engine(engine, serverSocket, directory);
+        close(serverSocket);
+        return 0;
+    }
+
+    // Every worker gets its own SO_REUSEPORT listener, so the kernel spreads
+    // incoming connections across them and no accept queue is shared
+    std::vector<int> serverSockets;
+    for(int i = 0; i < workerCount; i++){
+        int serverSocket = create_listen_socket(port, backlog, true);
+        if(serverSocket == INVALID_SOCKET) return 0;
+        serverSockets.push_back(serverSocket);
+    }
+    std::cout<<"Server started on port "<<port<<", serving files from "<<directory<<" ("<<engine<<" engine, "<<workerCount<<" workers)\n";
+
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    for(int i = 0; i < workerCount; i++){
+        std::thread worker([&, i]{
+            workerStats = &stats[i];
+            init_file_cache();
+            run_engine(engine, serverSockets[i], directory);
+        });
+        if(pinWorkers){
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cpuCount, &cpus);
+            if(pthread_setaffinity_np(worker.native_handle(), sizeof(cpus), &cpus) != 0){
+                std::cout<<"Could not pin worker "<<i<<" to CPU "<<(i % cpuCount)<<"\n";
+            }
+        }
+        worker.detach();
+    }
+
+    report_worker_stats(stats, statsInterval);
+    return 0;
+}
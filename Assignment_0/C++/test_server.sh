@@ -0,0 +1,59 @@
+#!/bin/bash
+# Protocol checks for server_linux, run against every engine over the
+# shipped static/ directory. Exits non-zero if any check fails.
+#
+#   ./test_server.sh
+#   ENGINES=epoll ./test_server.sh
+
+PORT=${PORT:-8098}
+ENGINES=${ENGINES:-"serial epoll uring"}
+FAILED=0
+
+echo "[+] Building..."
+make -s server_linux || exit 1
+
+# Send $1 (printf format) on one connection and print everything that comes
+# back until the server closes it, or 3 seconds pass
+exchange() {
+    exec 3<>/dev/tcp/127.0.0.1/$PORT || return 1
+    printf "$1" >&3
+    timeout 3 cat <&3 2>/dev/null
+    exec 3<&-
+}
+
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "    ok: $1"
+    else
+        echo "    FAILED: $1 (expected $3, got $2)"
+        FAILED=1
+    fi
+}
+
+for engine in $ENGINES; do
+    echo "[+] $engine"
+    ./server_linux $PORT static --engine $engine --log-file /dev/null > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5
+
+    # More pipelined requests than MAX_PIPELINE, all in one write. The
+    # serial engine answers one request per connection.
+    if [ $engine != serial ]; then
+        requests=""
+        for i in $(seq 1 39); do
+            requests+="GET /style.css HTTP/1.1\r\nHost: localhost\r\n\r\n"
+        done
+        requests+="GET /style.css HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+        responses=$(exchange "$requests" | grep -o "HTTP/1.1 200" | wc -l)
+        check "40 pipelined requests" "$responses" 40
+    fi
+
+    # ".." segments must not climb out of the served directory
+    status=$(exchange "GET /../../etc/hostname HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" | head -c 12)
+    check "path with .. is refused" "$status" "HTTP/1.1 400"
+
+    kill $SERVER_PID 2>/dev/null
+    wait $SERVER_PID 2>/dev/null
+done
+
+exit $FAILED
@@ -0,0 +1,102 @@
+// Hierarchical timing wheel for connection deadlines.
+// Four levels of 64 slots; level L holds timers due within 64^(L+1) ticks,
+// bucketed by 64^L ticks. Scheduling and cancelling are O(1) list splices on
+// a node embedded in the owner. Advancing one tick expires a single level-0
+// slot, and every 64 ticks the next level's current slot is redistributed
+// ("cascaded") into the finer levels, so no timer is ever scanned early.
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define WHEEL_MAX_DELAY ((1ull << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1)
+
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expiry = 0;     // tick at which the timer fires
+    int kind = 0;            // caller-defined meaning of the deadline
+    int64_t owner = 0;       // caller's key for whatever the timer belongs to
+
+    bool armed() const { return prev != nullptr; }
+};
+
+struct TimerWheel {
+    uint64_t now = 0;                            // last tick processed
+    TimerNode slots[WHEEL_LEVELS][WHEEL_SLOTS];  // list heads; an empty list points to itself
+
+    TimerWheel(){
+        for(auto& level : slots){
+            for(TimerNode& head : level) head.prev = head.next = &head;
+        }
+    }
+
+    // Nodes are embedded in their owners, so the wheel is neither copied nor moved.
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // (Re)arm `node` to fire at tick `expiry`.
+    void schedule(TimerNode& node, uint64_t expiry){
+        cancel(node);
+        if(expiry <= now) expiry = now + 1;
+        if(expiry - now > WHEEL_MAX_DELAY) expiry = now + WHEEL_MAX_DELAY;
+        node.expiry = expiry;
+        place(node);
+    }
+
+    void cancel(TimerNode& node){
+        if(!node.armed()) return;
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    // Move time forward to `target`, calling expired(node) for each timer
+    // that comes due. The node is unlinked first, so the callback may free
+    // its owner or re-arm it.
+    template <typename Fn>
+    void advance(uint64_t target, Fn expired){
+        while(now < target){
+            now++;
+            for(int level = 1; level < WHEEL_LEVELS; level++){
+                if((now & ((1ull << (WHEEL_SLOT_BITS * level)) - 1)) != 0) break;
+                cascade(level);
+            }
+            TimerNode& head = slots[0][now & (WHEEL_SLOTS - 1)];
+            while(head.next != &head){
+                TimerNode& node = *head.next;
+                cancel(node);
+                if(node.expiry <= now) expired(node);
+                else place(node);
+            }
+        }
+    }
+
+private:
+    void place(TimerNode& node){
+        uint64_t delay = node.expiry - now;
+        int level = 0;
+        while(level < WHEEL_LEVELS - 1 && delay >= (1ull << (WHEEL_SLOT_BITS * (level + 1)))) level++;
+        TimerNode& head = slots[level][(node.expiry >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    // Redistribute the slot of `level` that has just come into range.
+    void cascade(int level){
+        TimerNode& head = slots[level][(now >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)];
+        while(head.next != &head){
+            TimerNode& node = *head.next;
+            cancel(node);
+            place(node);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,378 @@
+// Benchmark for the chat server.
+// Logs in pairs of users; once everyone is connected it samples the server's
+// CPU use and thread count while all clients sit idle (--server-pid), then
+// every sender fires timestamped /msg commands at its partner at a fixed rate
+// and the receivers measure how long each message took to arrive. With
+// --broadcast only the first sender sends, as /broadcast, and every receiver
+// measures those. With --offline the receivers only log in once everything
+// has been sent, so every message goes through the server's offline store.
+// With --stalled the first receivers log in but never read, so the server
+// has to hold back their messages without holding up anyone else.
+// Clients use the framed protocol unless --legacy is given.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include "chat_protocol.h"
+
+#define BUFFER_SIZE 4096
+
+int port = 12345;
+int pair_count = 20;
+int message_count = 500;     // per sender
+int rate = 1000;             // messages per second per sender
+int idle_seconds = 3;
+int server_pid = 0;
+int first_user = 0;
+int payload_size = 0;        // filler bytes after each timestamp
+int stalled_count = 0;       // receivers that never read
+bool legacy = false;
+bool broadcast = false;
+bool offline = false;
+int sender_count = 0;        // senders that actually send
+
+std::mutex results_mutex;
+std::vector<uint64_t> latencies;   // nanoseconds
+std::atomic<bool> start_sending{false};
+std::atomic<int> senders_done{0};
+std::atomic<uint64_t> last_send_ns{0};   // when the last sender finished
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Send one command or login line in the selected protocol
+bool send_line(int sock, const std::string &line)
+{
+    std::string data = legacy ? line : encode_frame(FRAME_TEXT, line);
+    return send(sock, data.data(), data.size(), 0) == (ssize_t)data.size();
+}
+
+// Receive one login reply: a frame's payload, or one recv() in legacy mode
+bool recv_reply(int sock, FrameDecoder &decoder, std::string &reply)
+{
+    char buffer[BUFFER_SIZE];
+    Frame frame;
+    while (!legacy)
+    {
+        DecodeResult result = decoder.next(frame);
+        if (result == DECODE_FRAME)
+        {
+            reply = frame.payload;
+            return true;
+        }
+        if (result == DECODE_ERROR)
+            return false;
+        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0)
+            return false;
+        decoder.feed(buffer, bytes_received);
+    }
+    int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
+    if (bytes_received <= 0)
+        return false;
+    reply.assign(buffer, bytes_received);
+    return true;
+}
+
+// Connect and answer the username and password prompts. Returns the socket,
+// or -1. Frames that arrive right after the welcome stay in `decoder`.
+int login(int user, FrameDecoder &decoder)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Each command must leave in its own segment, or the server reads two as one
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(sock, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    char buffer[BUFFER_SIZE];
+    std::string username = "u" + std::to_string(user);
+    std::string password = "p" + std::to_string(user);
+    std::string hello = encode_frame(FRAME_HELLO, PROTOCOL_VERSION);
+    std::string reply;
+    if (recv(sock, buffer, BUFFER_SIZE, 0) <= 0 || (!legacy && send(sock, hello.data(), hello.size(), 0) <= 0) ||
+        !send_line(sock, username) || !recv_reply(sock, decoder, reply) || !send_line(sock, password) ||
+        !recv_reply(sock, decoder, reply) || reply.find("Welcome") == std::string::npos)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// A numeric field of /proc/<pid>/status, e.g. "Threads:" or "VmRSS:" (in kB)
+long process_status(int pid, const std::string &field)
+{
+    std::ifstream status_file("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status_file, line))
+    {
+        if (line.compare(0, field.size(), field) == 0)
+            return atol(line.c_str() + field.size());
+    }
+    return -1;
+}
+
+// Total CPU time of a process in clock ticks (user + system).
+long process_ticks(int pid)
+{
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat_file, line);
+    // Fields after the parenthesised command name; utime and stime are 14 and 15
+    size_t close_paren = line.rfind(')');
+    if (close_paren == std::string::npos)
+        return -1;
+    std::stringstream ss(line.substr(close_paren + 2));
+    std::string field;
+    long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && ss >> field; i++)
+    {
+        if (i == 14)
+            utime = std::stol(field);
+        if (i == 15)
+            stime = std::stol(field);
+    }
+    return utime + stime;
+}
+
+void run_sender(int sock, int receiver)
+{
+    while (!start_sending)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::string filler = payload_size > 0 ? " " + std::string(payload_size, 'x') : "";
+    uint64_t interval = 1000000000ull / rate;
+    uint64_t start = now_ns();
+    for (int i = 0; i < message_count; i++)
+    {
+        uint64_t due = start + i * interval;
+        uint64_t now = now_ns();
+        if (due > now)
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+        if (broadcast)
+            send_line(sock, "/broadcast " + std::to_string(now_ns()) + filler);
+        else
+            send_line(sock, "/msg u" + std::to_string(receiver) + " " + std::to_string(now_ns()) + filler);
+    }
+    if (++senders_done == sender_count)
+        last_send_ns = now_ns();
+}
+
+// Legacy messages arrive as "[sender]: text" with nothing in between, so
+// every "]: " followed by digits is one timestamp. Framed messages are
+// unpacked first and scanned the same way.
+void run_receiver(int sock, FrameDecoder decoder)
+{
+    timeval timeout{2, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::vector<uint64_t> local;
+    std::string pending;
+    char buffer[BUFFER_SIZE];
+    // Frames that came in with the login reply are already in the decoder
+    bool check_decoder = !legacy;
+    while ((int)local.size() < message_count)
+    {
+        int bytes_received = check_decoder ? 0 : recv(sock, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0 && !check_decoder)
+        {
+            // Give up once a whole timeout has passed since the last send;
+            // a timeout that started earlier says nothing about what is in flight
+            if (senders_done == sender_count && now_ns() - last_send_ns >= 2000000000ull)
+                break;
+            continue;
+        }
+        check_decoder = false;
+        uint64_t arrived = now_ns();
+        if (legacy)
+            pending.append(buffer, bytes_received);
+        else
+        {
+            decoder.feed(buffer, bytes_received);
+            Frame frame;
+            while (decoder.next(frame) == DECODE_FRAME)
+            {
+                if (frame.type == FRAME_CHAT)
+                    pending += frame.payload + "\n";
+            }
+        }
+        size_t pos = 0;
+        while (true)
+        {
+            size_t marker = pending.find("]: ", pos);
+            if (marker == std::string::npos)
+                break;
+            size_t digits = marker + 3;
+            size_t end = digits;
+            while (end < pending.size() && isdigit((unsigned char)pending[end]))
+                end++;
+            if (end == pending.size())
+                break;   // the timestamp may continue in the next read
+            if (end > digits)
+                local.push_back(arrived - std::stoull(pending.substr(digits, end - digits)));
+            pos = end;
+        }
+        pending.erase(0, pos);
+    }
+    std::lock_guard<std::mutex> lock(results_mutex);
+    latencies.insert(latencies.end(), local.begin(), local.end());
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--legacy" || arg == "--broadcast" || arg == "--offline")
+        {
+            (arg == "--legacy" ? legacy : arg == "--broadcast" ? broadcast : offline) = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << arg << "\n";
+            return 1;
+        }
+        int value = atoi(argv[++i]);
+        if (arg == "--port")
+            port = value;
+        else if (arg == "--pairs")
+            pair_count = value;
+        else if (arg == "--messages")
+            message_count = value;
+        else if (arg == "--rate")
+            rate = value;
+        else if (arg == "--idle")
+            idle_seconds = value;
+        else if (arg == "--server-pid")
+            server_pid = value;
+        else if (arg == "--first-user")
+            first_user = value;
+        else if (arg == "--payload")
+            payload_size = value;
+        else if (arg == "--stalled")
+            stalled_count = value;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--port <n>] [--pairs <n>] [--messages <n>] [--rate <per second>]\n"
+                      << "       [--idle <seconds>] [--server-pid <pid>] [--first-user <n>] [--payload <bytes>]\n"
+                      << "       [--stalled <receivers>] [--legacy] [--broadcast] [--offline]\n";
+            return 1;
+        }
+    }
+
+    // Log everyone in first, so the idle sample and the run see a full server
+    std::vector<int> senders, receivers;
+    std::vector<FrameDecoder> decoders(pair_count);
+    for (int i = 0; i < pair_count; i++)
+    {
+        FrameDecoder sender_decoder;
+        int sender = login(first_user + 2 * i, sender_decoder);
+        int receiver = offline ? 0 : login(first_user + 2 * i + 1, decoders[i]);
+        if (sender < 0 || receiver < 0)
+        {
+            std::cerr << "Login failed for pair " << i << "\n";
+            return 1;
+        }
+        senders.push_back(sender);
+        receivers.push_back(receiver);
+    }
+    std::cout << "Logged in " << (offline ? 1 : 2) * pair_count << " users\n";
+
+    if (server_pid > 0)
+    {
+        // Let the join notifications settle before sampling
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        long ticks_before = process_ticks(server_pid);
+        std::this_thread::sleep_for(std::chrono::seconds(idle_seconds));
+        long ticks_after = process_ticks(server_pid);
+        double cpu = 100.0 * (ticks_after - ticks_before) / sysconf(_SC_CLK_TCK) / idle_seconds;
+        std::cout << "Server CPU while idle: " << cpu << "% of one core\n";
+        std::cout << "Server threads: " << process_status(server_pid, "Threads:") << "\n";
+    }
+
+    sender_count = broadcast ? 1 : pair_count;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < pair_count; i++)
+    {
+        if (!offline && i >= stalled_count)
+            threads.emplace_back(run_receiver, receivers[i], std::move(decoders[i]));
+        if (i < sender_count)
+            threads.emplace_back(run_sender, senders[i], first_user + 2 * i + 1);
+    }
+    long ticks_before = server_pid > 0 ? process_ticks(server_pid) : 0;
+    uint64_t started = now_ns();
+    start_sending = true;
+    if (offline)
+    {
+        // Everything has to be stored before anyone can collect it. The run
+        // time is then how long the receivers take to be sent their backlog.
+        for (auto &thread : threads)
+            thread.join();
+        threads.clear();
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        if (server_pid > 0)
+            std::cout << "Server memory with everything stored: " << process_status(server_pid, "VmRSS:") / 1024 << " MB\n";
+        started = now_ns();
+        for (int i = 0; i < pair_count; i++)
+        {
+            receivers[i] = login(first_user + 2 * i + 1, decoders[i]);
+            if (receivers[i] < 0)
+            {
+                std::cerr << "Login failed for receiver " << i << "\n";
+                return 1;
+            }
+            threads.emplace_back(run_receiver, receivers[i], std::move(decoders[i]));
+        }
+    }
+    for (auto &thread : threads)
+        thread.join();
+    double seconds = (now_ns() - started) / 1e9;
+    if (server_pid > 0)
+        std::cout << "Server CPU during the run: " << (double)(process_ticks(server_pid) - ticks_before) / sysconf(_SC_CLK_TCK) << " s\n";
+    if (server_pid > 0 && stalled_count > 0)
+        std::cout << "Server memory with " << stalled_count << " stalled receivers: " << process_status(server_pid, "VmRSS:") / 1024 << " MB\n";
+
+    for (int sock : senders)
+        close(sock);
+    for (int sock : receivers)
+        close(sock);
+
+    size_t sent = (size_t)(pair_count - stalled_count) * message_count;   // expected deliveries to the receivers that read
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "Delivered " << latencies.size() << " of " << sent << " messages in " << seconds << " s\n";
+    if (latencies.empty())
+        return 1;
+    auto percentile = [&](double p)
+    {
+        return latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))] / 1000;
+    };
+    std::cout << "Latency (us): p50 " << percentile(0.50) << ", p99 " << percentile(0.99)
+              << ", p99.9 " << percentile(0.999) << ", max " << latencies.back() / 1000 << "\n";
+    return 0;
+}
@@ -0,0 +1,109 @@
+// Wire protocol shared by the chat server and client.
+//
+// Every frame is a 5-byte header followed by the payload:
+//
+//     +----------------------+--------+-------------------+
+//     | length (4 bytes, BE) | type   | payload (length)  |
+//     +----------------------+--------+-------------------+
+//
+// Frames are self-delimiting, so any number of them can be written with one
+// send() and read back with any split across recv() calls, and a payload is
+// no longer limited by the size of a recv() buffer.
+//
+// The server still opens every connection in the legacy text mode by sending
+// a plain "Enter username: " prompt. A client that wants frames answers with
+// a FRAME_HELLO frame before its username. Its first byte is then the high
+// byte of a small length, i.e. 0, which no text username can start with. A
+// client that answers with plain text stays in the legacy mode, where each
+// recv() is one message.
+
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#define FRAME_HEADER_SIZE 5
+#define MAX_FRAME_PAYLOAD (16 * 1024 * 1024)
+#define PROTOCOL_VERSION "CHAT/2"
+
+enum FrameType
+{
+    FRAME_HELLO = 1,    // client -> server, first frame; payload PROTOCOL_VERSION
+    FRAME_TEXT,         // client -> server: username, password or a command line
+    FRAME_NOTICE,       // server -> client: prompts, replies and join notices
+    FRAME_CHAT          // server -> client: a delivered message, "[sender]: text"
+};
+
+struct Frame
+{
+    uint8_t type = 0;
+    std::string payload;
+};
+
+// Append one encoded frame to `out`; call repeatedly to batch frames.
+inline void encode_frame(std::string &out, uint8_t type, const std::string &payload)
+{
+    uint32_t length = payload.size();
+    char header[FRAME_HEADER_SIZE] = {(char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length, (char)type};
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(payload);
+}
+
+inline std::string encode_frame(uint8_t type, const std::string &payload)
+{
+    std::string out;
+    encode_frame(out, type, payload);
+    return out;
+}
+
+enum DecodeResult
+{
+    DECODE_FRAME,        // `frame` holds the next frame
+    DECODE_NEED_MORE,    // feed more bytes
+    DECODE_ERROR         // oversized frame; the stream cannot be resynchronised
+};
+
+// Incremental decoder: feed() whatever recv() returned, then call next()
+// until it stops returning DECODE_FRAME. Bytes of an unfinished frame are
+// kept for the next feed().
+struct FrameDecoder
+{
+    std::string buffer;
+    size_t start = 0;      // first byte not yet consumed
+
+    void feed(const char *data, size_t length)
+    {
+        // Drop consumed bytes before they pile up
+        if (start > 0 && start == buffer.size())
+        {
+            buffer.clear();
+            start = 0;
+        }
+        else if (start > 65536 && start * 2 > buffer.size())
+        {
+            buffer.erase(0, start);
+            start = 0;
+        }
+        buffer.append(data, length);
+    }
+
+    DecodeResult next(Frame &frame)
+    {
+        if (buffer.size() - start < FRAME_HEADER_SIZE)
+            return DECODE_NEED_MORE;
+        const unsigned char *header = (const unsigned char *)buffer.data() + start;
+        uint32_t length = (uint32_t)header[0] << 24 | (uint32_t)header[1] << 16 | (uint32_t)header[2] << 8 | header[3];
+        if (length > MAX_FRAME_PAYLOAD)
+            return DECODE_ERROR;
+        if (buffer.size() - start < FRAME_HEADER_SIZE + length)
+            return DECODE_NEED_MORE;
+        frame.type = header[4];
+        frame.payload.assign(buffer, start + FRAME_HEADER_SIZE, length);
+        start += FRAME_HEADER_SIZE + length;
+        return DECODE_FRAME;
+    }
+};
+
+#endif
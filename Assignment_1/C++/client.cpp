@@ -12,22 +12,73 @@
 #include <cstdlib>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "chat_protocol.h"
 
 #define BUFFER_SIZE 1024
+#define FRAME_READ_SIZE 16384
 
 std::mutex cout_mutex;
+bool legacy = false;      // --legacy: plain text, one recv() per message
+FrameDecoder decoder;
+
+void disconnected(int server_socket) {
+    std::lock_guard<std::mutex> lock(cout_mutex);
+    std::cout << "Disconnected from server." << std::endl;
+    close(server_socket);
+    exit(0);
+}
+
+// Write all of `data`, however many send() calls it takes
+void send_all(int server_socket, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t bytes_sent = send(server_socket, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (bytes_sent <= 0) disconnected(server_socket);
+        done += bytes_sent;
+    }
+}
+
+// Send one line typed by the user, framed unless in legacy mode
+void send_line(int server_socket, const std::string& line) {
+    send_all(server_socket, legacy ? line : encode_frame(FRAME_TEXT, line));
+}
+
+// Wait for the next frame from the server and return its payload
+std::string recv_frame(int server_socket) {
+    Frame frame;
+    char buffer[FRAME_READ_SIZE];
+    while (true) {
+        DecodeResult result = decoder.next(frame);
+        if (result == DECODE_FRAME) return frame.payload;
+        if (result == DECODE_ERROR) disconnected(server_socket);
+        int bytes_received = recv(server_socket, buffer, FRAME_READ_SIZE, 0);
+        if (bytes_received <= 0) disconnected(server_socket);
+        decoder.feed(buffer, bytes_received);
+    }
+}
+
+// Receive one server reply during login
+std::string recv_reply(int server_socket) {
+    if (!legacy) return recv_frame(server_socket);
+    char buffer[BUFFER_SIZE];
+    memset(buffer, 0, BUFFER_SIZE);
+    recv(server_socket, buffer, BUFFER_SIZE, 0);
+    return buffer;
+}
 
 void handle_server_messages(int server_socket) {
+    if (!legacy) {
+        while (true) {
+            std::string message = recv_frame(server_socket);
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            std::cout << message << std::endl;
+        }
+    }
     char buffer[BUFFER_SIZE];
     while (true) {
         memset(buffer, 0, BUFFER_SIZE);
         int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "Disconnected from server." << std::endl;
-            close(server_socket);
-            exit(0);
-        }
+        if (bytes_received <= 0) disconnected(server_socket);
         std::lock_guard<std::mutex> lock(cout_mutex);
         //std::cout << buffer << std::endl;
         for(int i = 0; i < bytes_received; i++)
@@ -47,11 +98,12 @@ int main(int argc, char* argv[]) {
     int client_socket=0;
     sockaddr_in server_address{};
 
-    if(argc != 2)
+    if(argc < 2 || argc > 3 || (argc == 3 && std::string(argv[2]) != "--legacy"))
     {
-            std::cout << "Usage: "<< argv[0] << " <server port num>"<<  std::endl;
+            std::cout << "Usage: "<< argv[0] << " <server port num> [--legacy]"<<  std::endl;
 	    exit(-1);
     }
+    legacy = argc == 3;
 
     port=atoi(argv[1]);
     
@@ -83,20 +135,19 @@ int main(int argc, char* argv[]) {
  
     std::cout << buffer;
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
+    // The hello frame tells the server to switch this connection to frames
+    if (!legacy) send_all(client_socket, encode_frame(FRAME_HELLO, PROTOCOL_VERSION));
+    send_line(client_socket, username);
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
+    std::cout << recv_reply(client_socket); // Receive the message "Enter the password" for the server
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    send_line(client_socket, password);
 
-    memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
+    std::string reply = recv_reply(client_socket);
+    std::cout << reply << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+    if (reply.find("Authentication failed") != std::string::npos) {
         close(client_socket);
         return 1;
     }
@@ -113,7 +164,7 @@ int main(int argc, char* argv[]) {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        send_line(client_socket, message);
 
         if (message == "/exit") {
             close(client_socket);
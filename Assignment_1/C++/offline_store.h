@@ -0,0 +1,466 @@
+// On-disk store for messages to users who are offline.
+//
+// Each user with undelivered messages has a directory under the store root
+// holding append-only segment files, named by sequence number, and an index
+// file:
+//
+//     offline/<user>/00000003.seg    records, oldest segment first
+//     offline/<user>/00000004.seg    the last segment takes appends
+//     offline/<user>/index           "<segment> <offset>" of the first undelivered byte
+//
+// A record is the encoded FRAME_CHAT frame itself (see chat_protocol.h), so
+// replaying is mapping a segment and handing its bytes to the socket. Once
+// the socket has taken a batch, commit() advances the index, and a segment
+// is deleted as soon as the index has passed it, so delivered ranges never
+// stay on disk. A batch that was never sent in full is replayed again. A
+// user whose backlog grows past the retention limit loses their oldest
+// segments.
+//
+// The last segment of each log keeps its file open for appends, up to
+// offline_open_limit files in all; past that, appends open and close it.
+//
+// Appends are not synced one by one; a segment is synced when the log moves
+// on to the next one. The index is only written after the segment it points
+// into has been synced, and is itself synced before it replaces the old one.
+// A power loss can therefore lose the most recent appends, but never leaves
+// an index pointing past the data or a segment that is only half rewritten.
+//
+// An OfflineLog is not thread-safe; the server guards each one with a lock.
+
+#ifndef OFFLINE_STORE_H
+#define OFFLINE_STORE_H
+
+#include "chat_protocol.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define OFFLINE_SEGMENT_SIZE (1024 * 1024)
+#define OFFLINE_REPLAY_BATCH (256 * 1024)
+
+// Segment files held open for appends, across all logs
+inline std::atomic<int> offline_open_files{0};
+inline int offline_open_limit = 256;
+
+// A read-only mapping of part of a segment. Connections that still have
+// some of it queued share ownership, so it may outlive the file.
+struct SegmentMapping
+{
+    void *address = nullptr;
+    size_t length = 0;
+
+    ~SegmentMapping()
+    {
+        if (address != nullptr)
+            munmap(address, length);
+    }
+};
+
+// Whole frames, ready to send
+struct ReplayBatch
+{
+    std::shared_ptr<const SegmentMapping> mapping;
+    const char *data = nullptr;
+    size_t length = 0;
+};
+
+struct Segment
+{
+    uint64_t sequence;
+    uint64_t size;
+    int fd = -1;            // open for appends, last segment only
+    uint64_t synced = 0;    // bytes known to be on disk
+};
+
+// Length of the frame at `data`, or 0 if fewer than `available` bytes hold it
+inline size_t whole_frame_length(const char *data, size_t available)
+{
+    if (available < FRAME_HEADER_SIZE)
+        return 0;
+    const unsigned char *header = (const unsigned char *)data;
+    size_t length = FRAME_HEADER_SIZE + ((size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3]);
+    return length <= available ? length : 0;
+}
+
+struct OfflineLog
+{
+    std::string directory;
+    bool loaded = false;
+    std::vector<Segment> segments;   // oldest first
+    uint64_t next_sequence = 0;
+    uint64_t delivered_offset = 0;   // into segments.front()
+    uint64_t stored_bytes = 0;       // undelivered bytes on disk
+    bool outstanding = false;        // a replayed batch waits for commit()
+    uint64_t outstanding_sequence = 0;
+    uint64_t outstanding_end = 0;    // offset just past it
+
+    bool empty() const
+    {
+        return stored_bytes == 0;
+    }
+
+    std::string segment_path(uint64_t sequence) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "/%08llu.seg", (unsigned long long)sequence);
+        return directory + name;
+    }
+
+    // Pick up whatever an earlier run left in `dir`. Segments the index has
+    // passed are removed, and a record cut short by a crash is trimmed off.
+    void load(const std::string &dir)
+    {
+        directory = dir;
+        loaded = true;
+        DIR *handle = opendir(directory.c_str());
+        if (handle == nullptr)
+            return;
+        while (dirent *entry = readdir(handle))
+        {
+            std::string name = entry->d_name;
+            if (name.size() != 12 || name.compare(8, 4, ".seg") != 0)
+                continue;
+            struct stat info;
+            if (stat((directory + "/" + name).c_str(), &info) == 0)
+                segments.push_back({strtoull(name.c_str(), nullptr, 10), (uint64_t)info.st_size, -1, (uint64_t)info.st_size});
+        }
+        closedir(handle);
+        std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b)
+                  { return a.sequence < b.sequence; });
+
+        unsigned long long index_sequence = 0, index_offset = 0;
+        FILE *index = fopen((directory + "/index").c_str(), "r");
+        if (index != nullptr)
+        {
+            if (fscanf(index, "%llu %llu", &index_sequence, &index_offset) != 2)
+                index_sequence = index_offset = 0;
+            fclose(index);
+        }
+        while (!segments.empty() && segments.front().sequence < index_sequence)
+        {
+            unlink(segment_path(segments.front().sequence).c_str());
+            segments.erase(segments.begin());
+        }
+        if (!segments.empty() && segments.front().sequence == index_sequence)
+            delivered_offset = std::min<uint64_t>(index_offset, segments.front().size);
+        next_sequence = std::max<uint64_t>(index_sequence, segments.empty() ? 0 : segments.back().sequence + 1);
+
+        if (!segments.empty())
+        {
+            trim_torn_tail();
+            delivered_offset = std::min<uint64_t>(delivered_offset, segments.front().size);
+        }
+        for (const Segment &segment : segments)
+            stored_bytes += segment.size;
+        stored_bytes -= delivered_offset;
+    }
+
+    // Append one record. Once more than `limit` bytes are waiting, whole
+    // segments are dropped from the front; `dropped` says how many bytes.
+    bool append(const std::string &frame, uint64_t limit, uint64_t &dropped)
+    {
+        dropped = 0;
+        if (segments.empty() || segments.back().size >= OFFLINE_SEGMENT_SIZE)
+        {
+            if (!segments.empty())
+            {
+                sync_segment(segments.back());
+                close_segment(segments.back());
+            }
+            mkdir(directory.c_str(), 0700);
+            segments.push_back({next_sequence++, 0});
+            sync_directory();
+        }
+        Segment &segment = segments.back();
+        int fd = segment.fd;
+        if (fd < 0)
+        {
+            fd = open(segment_path(segment.sequence).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0600);
+            if (fd < 0)
+                return false;
+            if (offline_open_files.fetch_add(1) < offline_open_limit)
+                segment.fd = fd;
+            else
+                offline_open_files.fetch_sub(1);
+        }
+        size_t written = 0;
+        while (written < frame.size())
+        {
+            ssize_t bytes = write(fd, frame.data() + written, frame.size() - written);
+            if (bytes <= 0)
+                break;
+            written += bytes;
+        }
+        if (written < frame.size())
+        {
+            // Leave no half record behind
+            if (ftruncate(fd, segment.size) < 0)
+                perror("ftruncate() failed (offline segment)");
+            if (fd != segment.fd)
+                close(fd);
+            return false;
+        }
+        if (fd != segment.fd)
+            close(fd);
+        segment.size += frame.size();
+        stored_bytes += frame.size();
+
+        while (stored_bytes > limit && segments.size() > 1)
+        {
+            uint64_t bytes = segments.front().size - delivered_offset;
+            dropped += bytes;
+            stored_bytes -= bytes;
+            drop_front();
+        }
+        return true;
+    }
+
+    // Map the next batch of undelivered records, oldest first. They count as
+    // delivered only at commit(); until then, the next replay() hands out
+    // the same records again. Returns false once nothing is left.
+    bool replay(ReplayBatch &batch)
+    {
+        outstanding = false;
+        while (!segments.empty())
+        {
+            const Segment &segment = segments.front();
+            if (delivered_offset >= segment.size)
+            {
+                drop_front();
+                continue;
+            }
+            int fd = open(segment_path(segment.sequence).c_str(), O_RDONLY);
+            if (fd < 0)
+            {
+                perror("open() failed (offline segment)");
+                stored_bytes -= segment.size - delivered_offset;
+                drop_front();
+                continue;
+            }
+            uint64_t page = sysconf(_SC_PAGESIZE);
+            uint64_t map_start = delivered_offset / page * page;
+            auto mapping = std::make_shared<SegmentMapping>();
+            mapping->length = segment.size - map_start;
+            mapping->address = mmap(nullptr, mapping->length, PROT_READ, MAP_PRIVATE, fd, map_start);
+            close(fd);
+            if (mapping->address == MAP_FAILED)
+            {
+                mapping->address = nullptr;
+                perror("mmap() failed (offline segment)");
+                return false;
+            }
+            madvise(mapping->address, mapping->length, MADV_SEQUENTIAL);
+
+            // Whole frames only, and at least one however large
+            const char *start = (const char *)mapping->address + (delivered_offset - map_start);
+            size_t available = segment.size - delivered_offset;
+            size_t length = 0;
+            while (length < available && length < OFFLINE_REPLAY_BATCH)
+            {
+                size_t frame = whole_frame_length(start + length, available - length);
+                if (frame == 0)
+                    break;
+                length += frame;
+            }
+            if (length == 0)
+            {
+                // Nothing after a damaged record can be trusted; skip the
+                // rest. Records before it went out in an earlier batch.
+                stored_bytes -= segment.size - delivered_offset;
+                delivered_offset = segment.size;
+                drop_front();
+                continue;
+            }
+            outstanding = true;
+            outstanding_sequence = segment.sequence;
+            outstanding_end = delivered_offset + length;
+            batch.mapping = mapping;
+            batch.data = start;
+            batch.length = length;
+            return true;
+        }
+        return false;
+    }
+
+    // The batch from the last replay() has been sent; move the index past it
+    void commit()
+    {
+        if (!outstanding)
+            return;
+        outstanding = false;
+        // Retention may have dropped its segment in the meantime
+        if (segments.empty() || segments.front().sequence != outstanding_sequence || outstanding_end <= delivered_offset)
+            return;
+        stored_bytes -= outstanding_end - delivered_offset;
+        delivered_offset = outstanding_end;
+        if (delivered_offset >= segments.front().size)
+            drop_front();
+        else
+            write_index();
+    }
+
+    // Put records back in front of everything stored, e.g. messages that a
+    // closed connection never sent. The first segment is rewritten with
+    // them ahead of its undelivered part.
+    bool prepend(const std::string &records, uint64_t limit, uint64_t &dropped)
+    {
+        dropped = 0;
+        outstanding = false;
+        if (segments.empty())
+            return append(records, limit, dropped);
+        Segment &segment = segments.front();
+        std::string path = segment_path(segment.sequence);
+        std::string content = records;
+        content.resize(records.size() + (segment.size - delivered_offset));
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        size_t read_bytes = 0;
+        while (read_bytes < segment.size - delivered_offset)
+        {
+            ssize_t bytes = pread(fd, &content[records.size() + read_bytes], segment.size - delivered_offset - read_bytes, delivered_offset + read_bytes);
+            if (bytes <= 0)
+                break;
+            read_bytes += bytes;
+        }
+        close(fd);
+        if (read_bytes < segment.size - delivered_offset)
+            return false;
+
+        std::string temporary = path + ".tmp";
+        fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return false;
+        size_t written = 0;
+        while (written < content.size())
+        {
+            ssize_t bytes = write(fd, content.data() + written, content.size() - written);
+            if (bytes <= 0)
+                break;
+            written += bytes;
+        }
+        // On disk before it replaces the original
+        bool synced = written == content.size() && fdatasync(fd) == 0;
+        close(fd);
+        if (!synced || rename(temporary.c_str(), path.c_str()) < 0)
+        {
+            unlink(temporary.c_str());
+            return false;
+        }
+        // Appends must go to the new file, not the replaced one
+        close_segment(segment);
+        segment.size = segment.synced = content.size();
+        delivered_offset = 0;
+        stored_bytes += records.size();
+        write_index();
+        return true;
+    }
+
+private:
+    void close_segment(Segment &segment)
+    {
+        if (segment.fd < 0)
+            return;
+        close(segment.fd);
+        segment.fd = -1;
+        offline_open_files.fetch_sub(1);
+    }
+
+    void sync_segment(Segment &segment)
+    {
+        if (segment.synced == segment.size)
+            return;
+        int fd = segment.fd >= 0 ? segment.fd : open(segment_path(segment.sequence).c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        if (fdatasync(fd) == 0)
+            segment.synced = segment.size;
+        else
+            perror("fdatasync() failed (offline segment)");
+        if (fd != segment.fd)
+            close(fd);
+    }
+
+    // Make created, renamed and removed files in the log's directory durable
+    void sync_directory()
+    {
+        int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            return;
+        if (fsync(fd) < 0)
+            perror("fsync() failed (offline directory)");
+        close(fd);
+    }
+
+    void drop_front()
+    {
+        close_segment(segments.front());
+        unlink(segment_path(segments.front().sequence).c_str());
+        segments.erase(segments.begin());
+        delivered_offset = 0;
+        write_index();
+    }
+
+    // Record the delivered position; with nothing left, remove the directory
+    void write_index()
+    {
+        std::string index = directory + "/index";
+        if (segments.empty())
+        {
+            unlink(index.c_str());
+            rmdir(directory.c_str());
+            return;
+        }
+        // The index must not reach disk ahead of the bytes it points at
+        sync_segment(segments.front());
+        std::string temporary = index + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "w");
+        if (file == nullptr)
+            return;
+        fprintf(file, "%llu %llu\n", (unsigned long long)segments.front().sequence, (unsigned long long)delivered_offset);
+        bool synced = fflush(file) == 0 && fsync(fileno(file)) == 0;
+        fclose(file);
+        if (!synced || rename(temporary.c_str(), index.c_str()) < 0)
+        {
+            unlink(temporary.c_str());
+            return;
+        }
+        sync_directory();
+    }
+
+    void trim_torn_tail()
+    {
+        Segment &segment = segments.back();
+        std::string path = segment_path(segment.sequence);
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0 || segment.size == 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+        void *address = mmap(nullptr, segment.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED)
+        {
+            size_t whole = 0;
+            while (size_t frame = whole_frame_length((const char *)address + whole, segment.size - whole))
+                whole += frame;
+            munmap(address, segment.size);
+            if (whole < segment.size && ftruncate(fd, whole) == 0)
+                segment.size = whole;
+        }
+        close(fd);
+    }
+};
+
+#endif
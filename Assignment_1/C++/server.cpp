@@ -1,20 +1,43 @@
 // Include Stuff
+#include "chat_protocol.h"
+#include "offline_store.h"
+#include "user_store.h"
 #include <mutex>
 #include <thread>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include <unistd.h>
-#include <fstream>
 #include <sstream>
 #include <string.h>
-#include <map>
+#include <errno.h>
+#include <algorithm>
 #include <unordered_map>
-#include <set>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <condition_variable>
 #include <iostream>
+#include <filesystem>
 
 // Define macros
 #define BUFFER_SIZE 1024
-#define BACKLOG 10
+#define FRAME_READ_SIZE 16384
+#define READS_PER_EVENT 16
+#define MAX_EVENTS 256
+#define BACKLOG 128
+#define DELIVERY_BATCH 64
+#define OUTPUT_LIMIT (256 * 1024)
+#define MAX_IOVECS 64
+#define COALESCE_LIMIT 512
+#define COALESCE_BUFFER_SIZE 16384
+#define FANOUT_SLICE 1024
+#define RCU_IDLE UINT64_MAX
 
 namespace fs = std::filesystem;
 
@@ -25,19 +48,235 @@ int SOCKET_ERROR = -1;
 std::mutex cout_mutex;
 std::mutex global_mutex;
 
-std::unordered_map<int, std::mutex> group_mutex;
-std::unordered_map<int, std::mutex> client_send_mutexes;
-std::unordered_map<int, std::mutex> client_recv_mutexes;
+// Usernames and salted password hashes, see user_store.h. A user's index
+// in the store is their ID; names are only looked up where commands arrive.
+UserStore users;
 
-std::map<std::string, std::string> Passwords;
-std::map<std::string, int> client_socket;
-std::map<std::string, int> logged_in;
-std::map<std::string, std::set<std::string>> group;
-std::map<std::string, int> group_id;
+// Groups are known by the order they were created in
+struct Group
+{
+    std::mutex mutex;              // guards `members`
+    std::vector<int> members;      // user IDs, sorted
+};
+
+std::unordered_map<std::string, int> group_ids;   // guarded by global_mutex
+std::deque<Group> groups;                          // only grows, under global_mutex
+
+// Who is logged in: a dense list, and each user's place in it (-1 while
+// offline). Both guarded by global_mutex; readers use the snapshot below.
+std::vector<int> online_users;
+std::vector<int> online_position;
+
+// A copy of online_users as of one login or logout. It is never modified
+// once published, so broadcasts and presence notices read it without a
+// lock. A newer one replaces it with a single pointer store.
+struct OnlineSnapshot
+{
+    uint64_t version;
+    std::vector<int> users;
+};
+
+std::atomic<const OnlineSnapshot *> online_snapshot{nullptr};
+
+// Replaced snapshots are freed once every reactor has been through the top
+// of its event loop since, so no reader can still hold them. Each one is
+// kept with the epoch it was retired in.
+std::atomic<uint64_t> rcu_epoch{1};
+std::vector<std::pair<uint64_t, const OnlineSnapshot *>> retired_snapshots;   // guarded by global_mutex
+
+// Bytes that are never modified once built, so any number of connections
+// can queue the same copy
+typedef std::shared_ptr<const std::string> SharedBuffer;
+
+// A message waiting in its recipient's mailbox. `frame` is the encoded
+// FRAME_CHAT frame, shared by every recipient of a group message or
+// broadcast; legacy clients are sent it without the frame header.
+struct Message
+{
+    std::atomic<Message *> next{nullptr};
+    SharedBuffer frame;
+};
+
+struct Connection;
+
+// Every user has a mailbox: a lock-free multi-producer single-consumer queue
+// (Vyukov's intrusive design). Any reactor may push to it; only the reactor
+// that set `scheduled` pops from it. Messages for a user who is offline stay
+// parked here until they log in. Everything in the offline log is older than
+// everything in the mailbox.
+struct Mailbox
+{
+    int user = -1;
+    std::atomic<Message *> head;       // last pushed; producers swap this
+    Message *tail;                     // next to pop; consumer only
+    Message stub;
+    Message *held = nullptr;           // taken back after a pop, linked by `next`; go first; consumer only
+    std::atomic<int> size{0};          // pushed and not yet popped, or held
+    std::atomic<int64_t> bytes{0};     // frame bytes of those
+    std::atomic<int> reactor{-1};      // reactor serving the user while logged in
+    Connection *connection = nullptr;  // only touched by that reactor
+    std::atomic<bool> scheduled{false};
+    std::mutex store_mutex;            // guards `offline`, and `reactor` going to or from -1
+    OfflineLog offline;                // what arrived while the user was offline
+
+    Mailbox() : head(&stub), tail(&stub) {}
+
+    void push(Message *message)
+    {
+        message->next.store(nullptr, std::memory_order_relaxed);
+        Message *prev = head.exchange(message, std::memory_order_acq_rel);
+        prev->next.store(message, std::memory_order_release);
+    }
+
+    // Put a popped message back, to be popped again before anything else.
+    // Producers never touch a message once it has been popped.
+    void hold(Message *message)
+    {
+        message->next.store(held, std::memory_order_relaxed);
+        held = message;
+    }
+
+    // Returns nullptr when empty, or when a push is still halfway through
+    Message *pop()
+    {
+        if (held != nullptr)
+        {
+            Message *message = held;
+            held = message->next.load(std::memory_order_relaxed);
+            return message;
+        }
+        Message *first = tail;
+        Message *next = first->next.load(std::memory_order_acquire);
+        if (first == &stub)
+        {
+            if (next == nullptr)
+                return nullptr;
+            tail = next;
+            first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr)
+        {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(std::memory_order_acquire))
+            return nullptr;
+        push(&stub);
+        next = first->next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+// One per user, indexed by user ID. Sized once before any client connects.
+std::vector<Mailbox> mailboxes;
+
+// Where a connection is in the login sequence
+enum ConnectionState
+{
+    STATE_USERNAME,    // "Enter username: " sent
+    STATE_HELLO,       // reply started with a zero byte; the hello frame is arriving
+    STATE_PASSWORD,    // "Enter password: " sent
+    STATE_ONLINE       // logged in; input is commands
+};
+
+// Queued output. `owner` keeps the bytes alive: a SharedBuffer or an offline
+// segment mapping, either possibly shared with other connections.
+struct OutputChunk
+{
+    std::shared_ptr<const void> owner;
+    const char *data;   // first byte not yet sent
+    size_t length;      // bytes left
+    bool replayed = false;   // part of the offline batch being replayed
+};
+
+// One client. Owned by a single reactor, and only touched by its thread.
+struct Connection
+{
+    int socket;
+    int reactor;
+    ConnectionState state = STATE_USERNAME;
+    bool framed = false;          // speaks the framed protocol, see chat_protocol.h
+    bool closed = false;          // closed during this turn, freed at its end
+    bool want_write = false;      // EPOLLOUT is armed
+    bool replaying = false;       // offline messages still on disk; the mailbox waits
+    std::string username;
+    int user = -1;                // user ID, set on login
+    Mailbox *mailbox = nullptr;   // set on login
+    FrameDecoder decoder;
+    std::deque<OutputChunk> output;   // queued bytes the socket has not taken yet
+    size_t output_bytes = 0;          // how many
+    uint64_t sent_bytes = 0;          // taken by the socket, ever
+    std::shared_ptr<std::string> coalesce;   // where small output is copied together
+    size_t replay_unsent = 0;         // of the replayed batch; it is committed at 0
+    // Messages taken from the mailbox, with where they end in the output
+    // stream, until the socket has taken all of them
+    std::deque<std::pair<SharedBuffer, uint64_t>> in_flight;
+};
+
+// A reactor is one thread running an epoll loop over its connections. It
+// reads and answers their commands and delivers their mailboxes, so the
+// thread count no longer grows with the number of users. Other threads hand
+// it work through the inbox and wake it with the eventfd.
+struct Reactor
+{
+    int index;
+    int epoll_fd;
+    int wake_fd;
+    std::mutex inbox_mutex;
+    std::vector<int> new_sockets;              // accepted, not yet registered
+    std::vector<Mailbox *> ready_mailboxes;    // have messages for one of our users
+    bool wake_pending = false;                 // wake_fd already signalled
+    std::vector<Connection *> closed;          // freed after the current batch of events
+    std::atomic<uint64_t> seen_epoch{RCU_IDLE};   // rcu_epoch when this batch started; RCU_IDLE while waiting
+};
+
+std::deque<Reactor> reactors;
+
+// Counts down the slices of one fan-out
+struct FanoutLatch
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t remaining;
+};
+
+// Part of a large fan-out, run by a fan-out worker
+struct FanoutTask
+{
+    const int *recipients;   // user IDs
+    size_t count;
+    int skip;                // the sender, who gets no copy
+    SharedBuffer frame;
+    FanoutLatch *latch;
+};
+
+int fanout_workers = 0;
+std::mutex fanout_mutex;
+std::condition_variable fanout_cv;
+std::deque<FanoutTask> fanout_tasks;
 
-// [sender, receiver, message]
-std::queue<std::tuple<std::string, std::string, std::string>> msgs;
-int group_count = 0;
+// Messages for offline users go to disk, see offline_store.h; a limit of 0
+// keeps them in memory instead
+std::string offline_dir = "offline";
+uint64_t offline_limit = 64ull * 1024 * 1024;
+
+// What happens to a client that stops reading, once its mailbox holds more
+// than queue_limit bytes on top of a full output queue
+enum SlowConsumerPolicy
+{
+    SLOW_SPILL,          // move the oldest messages to the offline log; drop them if there is none
+    SLOW_DROP_OLDEST,    // drop the oldest messages
+    SLOW_DISCONNECT      // close the connection; the mailbox goes to the offline log
+};
+
+SlowConsumerPolicy slow_policy = SLOW_SPILL;
+int64_t queue_limit = 4ll * 1024 * 1024;
 
 // Print the server logs
 void server_logs(std::string log)
@@ -46,12 +285,465 @@ void server_logs(std::string log)
     std::cout << "Server Logs: " << log << "\n";
 }
 
+// Pass a new socket or a ready mailbox to a reactor
+void wake_reactor(Reactor &reactor, int socket, Mailbox *mailbox)
+{
+    bool signal = false;
+    {
+        std::lock_guard<std::mutex> lock(reactor.inbox_mutex);
+        if (mailbox != nullptr)
+            reactor.ready_mailboxes.push_back(mailbox);
+        else
+            reactor.new_sockets.push_back(socket);
+        signal = !reactor.wake_pending;
+        reactor.wake_pending = true;
+    }
+    if (signal)
+    {
+        uint64_t one = 1;
+        if (write(reactor.wake_fd, &one, sizeof(one)) < 0)
+            perror("write() failed (eventfd)");
+    }
+}
+
+// Hand the mailbox to the reactor serving its owner, unless it already has it
+void schedule_mailbox(Mailbox &mailbox)
+{
+    while (!mailbox.scheduled.exchange(true))
+    {
+        int index = mailbox.reactor.load();
+        if (index >= 0)
+        {
+            wake_reactor(reactors[index], -1, &mailbox);
+            return;
+        }
+        // The owner went offline. A login racing with us may have found the
+        // mailbox scheduled and backed off, so look again after letting go.
+        mailbox.scheduled.store(false);
+        if (mailbox.reactor.load() < 0)
+            return;
+    }
+}
+
+// Encode "[sender]: text" once, for however many recipients
+SharedBuffer chat_frame(const std::string &sender, const std::string &text)
+{
+    std::string payload;
+    payload.reserve(sender.size() + text.size() + 4);
+    payload += "[";
+    payload += sender;
+    payload += "]: ";
+    payload += text;
+    return std::make_shared<const std::string>(encode_frame(FRAME_CHAT, payload));
+}
+
+// Append a message to the user's offline log. The caller holds store_mutex.
+bool store_offline(Mailbox &mailbox, const std::string &frame)
+{
+    if (!mailbox.offline.loaded)
+        mailbox.offline.load(offline_dir + "/" + users.name(mailbox.user));
+    uint64_t dropped;
+    if (!mailbox.offline.append(frame, offline_limit, dropped))
+    {
+        server_logs("Failed to store offline message for " + users.name(mailbox.user) + ", keeping it in memory");
+        return false;
+    }
+    if (dropped > 0)
+        server_logs("Offline backlog of " + users.name(mailbox.user) + " is full, dropped " + std::to_string(dropped) + " bytes of old messages");
+    return true;
+}
+
+// Move the whole mailbox of a user who is offline to their log, oldest
+// first. A message that cannot be stored stays at the front, and so does
+// everything behind it. The caller holds store_mutex, which makes it the
+// mailbox's only consumer while `reactor` is -1.
+void store_mailbox(Mailbox &mailbox)
+{
+    while (true)
+    {
+        Message *message = mailbox.pop();
+        if (message == nullptr)
+            break;
+        if (!store_offline(mailbox, *message->frame))
+        {
+            mailbox.hold(message);
+            break;
+        }
+        mailbox.size.fetch_sub(1, std::memory_order_relaxed);
+        mailbox.bytes.fetch_sub(message->frame->size(), std::memory_order_relaxed);
+        delete message;
+    }
+}
+
+// Queue a message for the mailbox's owner: in the mailbox if they are
+// online, so it is delivered now, otherwise in their offline log
+void post_frame(Mailbox &mailbox, const SharedBuffer &frame)
+{
+    if (offline_limit > 0 && mailbox.reactor.load() < 0)
+    {
+        // Logins and logouts flip `reactor` under the same lock. Messages
+        // the log could not take stay in the mailbox; do not overtake them.
+        std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+        if (mailbox.reactor.load() < 0 && mailbox.size.load() == 0 && store_offline(mailbox, *frame))
+            return;
+    }
+    Message *message = new Message;
+    message->frame = frame;
+    mailbox.bytes.fetch_add(frame->size(), std::memory_order_relaxed);
+    mailbox.push(message);
+    mailbox.size.fetch_add(1);
+    if (mailbox.reactor.load() >= 0)
+        schedule_mailbox(mailbox);
+    else if (offline_limit > 0)
+    {
+        // The owner logged out after the check above, and their mailbox may
+        // already have gone to the log. Send this after it, or it would wait
+        // behind newer messages.
+        std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+        if (mailbox.reactor.load() < 0)
+            store_mailbox(mailbox);
+    }
+}
+
+void post_message(const std::string &sender, const std::string &receiver, const std::string &text)
+{
+    int user = users.find(receiver);
+    if (user < 0)
+    {
+        server_logs("Dropping message from " + sender + " to unknown user " + receiver);
+        return;
+    }
+    post_frame(mailboxes[user], chat_frame(sender, text));
+}
+
+void fanout_worker()
+{
+    while (true)
+    {
+        FanoutTask task;
+        {
+            std::unique_lock<std::mutex> lock(fanout_mutex);
+            fanout_cv.wait(lock, []
+                           { return !fanout_tasks.empty(); });
+            task = std::move(fanout_tasks.front());
+            fanout_tasks.pop_front();
+        }
+        for (size_t i = 0; i < task.count; i++)
+        {
+            if (task.recipients[i] != task.skip)
+                post_frame(mailboxes[task.recipients[i]], task.frame);
+        }
+        std::lock_guard<std::mutex> lock(task.latch->mutex);
+        if (--task.latch->remaining == 0)
+            task.latch->cv.notify_one();
+    }
+}
+
+// Post one frame to every recipient but `skip`. Large fan-outs are cut into
+// slices that the fan-out workers post in parallel with this thread. It
+// waits for all of them, so the sender's later messages cannot overtake this
+// one, and a snapshot passed as `recipients` stays alive throughout.
+void fan_out(const std::vector<int> &recipients, int skip, const SharedBuffer &frame)
+{
+    size_t slices = (recipients.size() + FANOUT_SLICE - 1) / FANOUT_SLICE;
+    if (slices <= 1 || fanout_workers == 0)
+    {
+        for (int user : recipients)
+        {
+            if (user != skip)
+                post_frame(mailboxes[user], frame);
+        }
+        return;
+    }
+
+    FanoutLatch latch;
+    latch.remaining = slices - 1;
+    {
+        std::lock_guard<std::mutex> lock(fanout_mutex);
+        for (size_t start = FANOUT_SLICE; start < recipients.size(); start += FANOUT_SLICE)
+            fanout_tasks.push_back({recipients.data() + start, std::min((size_t)FANOUT_SLICE, recipients.size() - start), skip, frame, &latch});
+    }
+    fanout_cv.notify_all();
+    for (size_t i = 0; i < FANOUT_SLICE; i++)
+    {
+        if (recipients[i] != skip)
+            post_frame(mailboxes[recipients[i]], frame);
+    }
+    std::unique_lock<std::mutex> lock(latch.mutex);
+    latch.cv.wait(lock, [&]
+                  { return latch.remaining == 0; });
+}
+
+size_t pending_output(Connection *connection)
+{
+    return connection->output_bytes;
+}
+
+// Queue `length` bytes at `data`, kept alive by `owner`; flush_output() sends
+// them. Small pieces of framed output are copied together instead, so one
+// sendmsg() is not spent on dozens of tiny iovecs; legacy clients need each
+// message kept apart.
+void queue_bytes(Connection *connection, std::shared_ptr<const void> owner, const char *data, size_t length)
+{
+    connection->output_bytes += length;
+    if (!connection->framed || length > COALESCE_LIMIT)
+    {
+        connection->output.push_back({std::move(owner), data, length});
+        return;
+    }
+    std::string *buffer = connection->coalesce.get();
+    bool open = buffer != nullptr && !connection->output.empty() && connection->output.back().owner == connection->coalesce;
+    if (!open || buffer->size() + length > buffer->capacity())
+    {
+        // Reuse the last buffer once the socket has taken all of it
+        if (buffer != nullptr && !open && connection->coalesce.use_count() == 1)
+            buffer->clear();
+        else
+        {
+            connection->coalesce = std::make_shared<std::string>();
+            buffer = connection->coalesce.get();
+            buffer->reserve(COALESCE_BUFFER_SIZE);
+        }
+        connection->output.push_back({connection->coalesce, buffer->data(), 0});
+    }
+    // Within the capacity, so the queued chunk's bytes stay put
+    buffer->append(data, length);
+    connection->output.back().length += length;
+}
+
+void queue_buffer(Connection *connection, const SharedBuffer &data, size_t offset)
+{
+    queue_bytes(connection, data, data->data() + offset, data->size() - offset);
+}
+
+// Queue one piece of text in the client's protocol: as a frame of `type`,
+// or as plain bytes to a legacy client
+void queue_text(Connection *connection, uint8_t type, const std::string &text)
+{
+    if (connection->framed && FRAME_HEADER_SIZE + text.size() <= COALESCE_LIMIT)
+    {
+        std::string frame = encode_frame(type, text);
+        queue_bytes(connection, nullptr, frame.data(), frame.size());
+    }
+    else if (connection->framed)
+        queue_buffer(connection, std::make_shared<const std::string>(encode_frame(type, text)), 0);
+    else
+        queue_buffer(connection, std::make_shared<const std::string>(text), 0);
+}
+
+// Free the retired snapshots that every reactor has moved past. The caller
+// holds global_mutex.
+void reclaim_snapshots()
+{
+    uint64_t oldest = RCU_IDLE;
+    for (Reactor &reactor : reactors)
+        oldest = std::min(oldest, reactor.seen_epoch.load());
+    size_t kept = 0;
+    for (auto &[epoch, snapshot] : retired_snapshots)
+    {
+        if (epoch <= oldest)
+            delete snapshot;
+        else
+            retired_snapshots[kept++] = {epoch, snapshot};
+    }
+    retired_snapshots.resize(kept);
+}
+
+// Replace the published snapshot with a copy of online_users. The caller
+// holds global_mutex; the new snapshot stays valid until its reactor's
+// current batch of events is over.
+const OnlineSnapshot *publish_online()
+{
+    const OnlineSnapshot *snapshot = new OnlineSnapshot{online_snapshot.load()->version + 1, online_users};
+    const OnlineSnapshot *previous = online_snapshot.exchange(snapshot);
+    // A reactor that sees the new epoch loads the new snapshot after that
+    retired_snapshots.push_back({rcu_epoch.fetch_add(1) + 1, previous});
+    reclaim_snapshots();
+    return snapshot;
+}
+
+// Add or remove a user from the online list. The caller holds global_mutex.
+const OnlineSnapshot *set_online(int user)
+{
+    online_position[user] = online_users.size();
+    online_users.push_back(user);
+    return publish_online();
+}
+
+void set_offline(int user)
+{
+    int position = online_position[user];
+    int last = online_users.back();
+    online_users[position] = last;
+    online_position[last] = position;
+    online_users.pop_back();
+    online_position[user] = -1;
+    publish_online();
+}
+
+// The group called `name`, or nullptr. Entries of a deque stay put as it
+// grows, so the result can be used after the lock is released.
+Group *find_group(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(global_mutex);
+    auto it = group_ids.find(name);
+    return it == group_ids.end() ? nullptr : &groups[it->second];
+}
+
+// Messages the socket never took in full are older than anything stored or
+// still in the mailbox: put them back in front. A replayed batch that was
+// not sent is still in the log. The caller holds store_mutex.
+void restore_unsent(Connection *connection, Mailbox &mailbox)
+{
+    if (connection->in_flight.empty())
+        return;
+    if (offline_limit > 0)
+    {
+        std::string records;
+        for (auto &[frame, end] : connection->in_flight)
+            records += *frame;
+        if (!mailbox.offline.loaded)
+            mailbox.offline.load(offline_dir + "/" + users.name(mailbox.user));
+        uint64_t dropped;
+        if (mailbox.offline.prepend(records, offline_limit, dropped))
+        {
+            connection->in_flight.clear();
+            return;
+        }
+        server_logs("Failed to store unsent messages for " + connection->username + ", keeping them in memory");
+    }
+    for (auto it = connection->in_flight.rbegin(); it != connection->in_flight.rend(); ++it)
+    {
+        Message *message = new Message;
+        message->frame = it->first;
+        mailbox.hold(message);
+        mailbox.size.fetch_add(1, std::memory_order_relaxed);
+        mailbox.bytes.fetch_add(message->frame->size(), std::memory_order_relaxed);
+    }
+    connection->in_flight.clear();
+}
+
+void close_connection(Connection *connection)
+{
+    if (connection->closed)
+        return;
+    connection->closed = true;
+    if (connection->state == STATE_ONLINE)
+    {
+        server_logs("Disconnected from client " + connection->username);
+        Mailbox &mailbox = *connection->mailbox;
+        {
+            // Messages from now on go to the offline log, after whatever the
+            // mailbox still holds. We are its only consumer while it is ours.
+            std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+            mailbox.reactor.store(-1);
+            mailbox.connection = nullptr;
+            restore_unsent(connection, mailbox);
+            if (offline_limit > 0)
+                store_mailbox(mailbox);
+        }
+        std::lock_guard<std::mutex> lock(global_mutex);
+        set_offline(connection->user);
+    }
+    else
+    {
+        server_logs("Disconnected from client at socket " + std::to_string(connection->socket));
+    }
+    Reactor &reactor = reactors[connection->reactor];
+    epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, connection->socket, nullptr);
+    close(connection->socket);
+    reactor.closed.push_back(connection);
+}
+
+// `bytes` of the replayed batch are done with; once all of it is, the log
+// may count it as delivered
+void replay_sent(Connection *connection, size_t bytes)
+{
+    connection->replay_unsent -= bytes;
+    if (connection->replay_unsent > 0)
+        return;
+    Mailbox &mailbox = *connection->mailbox;
+    std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+    mailbox.offline.commit();
+}
+
+// Write as much queued output as the socket takes, up to MAX_IOVECS chunks
+// per sendmsg(), and watch for EPOLLOUT only while some is left. Returns
+// false if the connection was closed.
+bool flush_output(Connection *connection)
+{
+    while (pending_output(connection) > 0)
+    {
+        iovec iov[MAX_IOVECS];
+        int count = 0;
+        for (auto &chunk : connection->output)
+        {
+            if (count == MAX_IOVECS)
+                break;
+            iov[count].iov_base = (void *)chunk.data;
+            iov[count].iov_len = chunk.length;
+            count++;
+        }
+        msghdr message{};
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t bytes_sent = sendmsg(connection->socket, &message, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        if (bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (bytes_sent <= 0)
+        {
+            close_connection(connection);
+            return false;
+        }
+
+        // Drop what went out; the last chunk may have gone only in part
+        connection->output_bytes -= bytes_sent;
+        connection->sent_bytes += bytes_sent;
+        size_t replayed_sent = 0;
+        while (bytes_sent > 0)
+        {
+            OutputChunk &chunk = connection->output.front();
+            size_t taken = std::min((size_t)bytes_sent, chunk.length);
+            if (chunk.replayed)
+                replayed_sent += taken;
+            bytes_sent -= taken;
+            if (taken < chunk.length)
+            {
+                chunk.data += taken;
+                chunk.length -= taken;
+                break;
+            }
+            connection->output.pop_front();
+        }
+        while (!connection->in_flight.empty() && connection->in_flight.front().second <= connection->sent_bytes)
+            connection->in_flight.pop_front();
+        if (replayed_sent > 0)
+            replay_sent(connection, replayed_sent);
+    }
+
+    bool want_write = pending_output(connection) > 0;
+    if (want_write != connection->want_write)
+    {
+        epoll_event event{};
+        event.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+        event.data.ptr = connection;
+        epoll_ctl(reactors[connection->reactor].epoll_fd, EPOLL_CTL_MOD, connection->socket, &event);
+        connection->want_write = want_write;
+    }
+
+    // Delivery pauses while too much is unsent; pick it up again
+    if (connection->state == STATE_ONLINE && pending_output(connection) < OUTPUT_LIMIT && connection->replay_unsent == 0 && (connection->replaying || connection->mailbox->size.load() > 0))
+        schedule_mailbox(*connection->mailbox);
+    return true;
+}
+
 // Handle user messages
-void handle_messages(std::string username, char *buffer)
+void handle_messages(Connection *connection, const std::string &message)
 {
-    std::string message = buffer;
+    std::string username = connection->username;
     std::string word = "";
-    int id = client_socket[username];
     // read first word
     std::stringstream ss(message);
     ss >> word;
@@ -62,10 +754,14 @@ void handle_messages(std::string username, char *buffer)
         std::string receiver, msg;
         ss >> receiver;
         getline(ss, msg);
+        if (msg.empty())
+        {
+            queue_text(connection, FRAME_NOTICE, "Usage: /msg <user> <message>");
+            return;
+        }
         msg = msg.substr(1);
         server_logs("Message from " + username + " to " + receiver + ": " + msg);
-        std::lock_guard<std::mutex> lock(global_mutex);
-        msgs.push({username, receiver, msg});
+        post_message(username, receiver, msg);
     }
     else if (word == "/create_group")
     {
@@ -73,29 +769,20 @@ void handle_messages(std::string username, char *buffer)
         ss >> group_name;
         {
             std::lock_guard<std::mutex> lock(global_mutex);
-<<<<<<< HEAD
-            if(group.count(group_name)){
-                std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-=======
-            if (group.count(group_name))
+            if (group_ids.count(group_name))
             {
-                std::lock_guard<std::mutex> lock(client_mutexes[id]);
->>>>>>> 76a6057c0cf5c1e2ef51f8517b23356bef875afb
                 std::string response = "Group " + group_name + " already exists";
-                send(client_socket[username], response.c_str(), response.size(), 0);
+                queue_text(connection, FRAME_NOTICE, response);
                 return;
             }
-            group[group_name].insert(username);
-            group_id[group_name] = group_count++;
+            group_ids[group_name] = groups.size();
+            groups.emplace_back();
+            groups.back().members.push_back(connection->user);
         }
         server_logs("Group " + group_name + " created by " + username);
 
-        {
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-
-            std::string response = "Group " + group_name + " created";
-            send(client_socket[username], response.c_str(), response.size(), 0);
-        }
+        std::string response = "Group " + group_name + " created";
+        queue_text(connection, FRAME_NOTICE, response);
     }
     else if (word == "/join_group")
     {
@@ -103,348 +790,552 @@ void handle_messages(std::string username, char *buffer)
         ss >> group_name;
 
         // Check if the group exists
-<<<<<<< HEAD
-        if(!group_id.count(group_name)){
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-=======
-        if (!group_id.count(group_name))
+        Group *joined = find_group(group_name);
+        if (joined == nullptr)
         {
-            std::lock_guard<std::mutex> lock(client_mutexes[id]);
->>>>>>> 76a6057c0cf5c1e2ef51f8517b23356bef875afb
-
             std::string response = "Group " + group_name + " does not exist";
-            send(client_socket[username], response.c_str(), response.size(), 0);
-
+            queue_text(connection, FRAME_NOTICE, response);
             return;
         }
 
         // Handle group logic
-        int id = group_id[group_name];
         {
-            std::lock_guard<std::mutex> lock(group_mutex[id]);
-            group[group_name].insert(username);
+            std::lock_guard<std::mutex> lock(joined->mutex);
+            auto it = std::lower_bound(joined->members.begin(), joined->members.end(), connection->user);
+            if (it == joined->members.end() || *it != connection->user)
+                joined->members.insert(it, connection->user);
         }
 
         server_logs(username + " joined group " + group_name);
 
-        {
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-            std::string response = "Joined group " + group_name;
-            send(client_socket[username], response.c_str(), response.size(), 0);
-        }
+        std::string response = "Joined group " + group_name;
+        queue_text(connection, FRAME_NOTICE, response);
     }
     else if (word == "/group_msg")
     {
         std::string group_name, msg;
         ss >> group_name;
-        int id = group_id[group_name];
         getline(ss, msg);
+        if (msg.empty())
+        {
+            queue_text(connection, FRAME_NOTICE, "Usage: /group_msg <group> <message>");
+            return;
+        }
         msg = msg.substr(1);
         server_logs("Message from " + username + " to group " + group_name + ": " + msg);
-        std::set<std::string> members;
+        Group *target = find_group(group_name);
+        if (target == nullptr)
         {
-            std::lock_guard<std::mutex> lock(group_mutex[id]);
-            for (auto member : group[group_name])
-            {
-                members.insert(member);
-            }
+            std::string response = "Group " + group_name + " does not exist";
+            queue_text(connection, FRAME_NOTICE, response);
+            return;
         }
-
-        std::lock_guard<std::mutex> lock(global_mutex);
-        for (auto member : members)
+        std::vector<int> members;
         {
-            if (member == username)
-                continue;
-            msgs.push({"Group " + group_name, member, msg});
+            std::lock_guard<std::mutex> lock(target->mutex);
+            members = target->members;
         }
+        fan_out(members, connection->user, chat_frame("Group " + group_name, msg));
     }
     else if (word == "/leave_group")
     {
         std::string group_name;
         ss >> group_name;
-        int group_exists = 0;
-        int is_member = 0;
+        // Leave the group, if the user is a member of it
+        bool is_member = false;
+        Group *left = find_group(group_name);
+        if (left != nullptr)
         {
-            std::lock_guard<std::mutex> lock(global_mutex);
-            group_exists = group_id.count(group_name);
-            is_member = group[group_name].count(username);
+            std::lock_guard<std::mutex> lock(left->mutex);
+            auto it = std::lower_bound(left->members.begin(), left->members.end(), connection->user);
+            is_member = it != left->members.end() && *it == connection->user;
+            if (is_member)
+                left->members.erase(it);
         }
-        // Check if user is a member of the group or not
-        if (!group_exists || !is_member)
+        if (!is_member)
         {
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-
             std::string response = "User " + username + " not a member of group " + group_name;
-            send(client_socket[username], response.c_str(), response.size(), 0);
-
+            queue_text(connection, FRAME_NOTICE, response);
             return;
         }
-
-        // Handle group leaving logic
-        int id = -1;
-        {
-            std::lock_guard<std::mutex> lock(global_mutex);
-            id = group_id[group_name];
-        }
-        {
-            std::lock_guard<std::mutex> lock(group_mutex[id]);
-            group[group_name].erase(username);
-        }
         server_logs(username + " left group " + group_name);
 
-        {
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-            std::string response = "Left group " + group_name;
-            send(client_socket[username], response.c_str(), response.size(), 0);
-        }
+        std::string response = "Left group " + group_name;
+        queue_text(connection, FRAME_NOTICE, response);
     }
     else if (word == "/broadcast")
     {
         std::string msg;
         getline(ss, msg);
-        msg = msg.substr(1);
-        server_logs("Broadcast message from " + username + ": " + msg);
-        std::lock_guard<std::mutex> lock(global_mutex);
-        for (auto [client, logged_in] : logged_in)
+        if (msg.empty())
         {
-            if (client == username)
-                continue;
-            if (logged_in == 1)
-            {
-                msgs.push({"BROADCAST " + username, client, msg});
-            }
+            queue_text(connection, FRAME_NOTICE, "Usage: /broadcast <message>");
+            return;
         }
+        msg = msg.substr(1);
+        server_logs("Broadcast message from " + username + ": " + msg);
+        // No lock: the snapshot stays valid until this batch of events is over
+        const OnlineSnapshot *online = online_snapshot.load();
+        fan_out(online->users, connection->user, chat_frame("BROADCAST " + username, msg));
     }
     else
     {
-        std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
         std::string response = "Invalid command";
-        send(client_socket[username], response.c_str(), response.size(), 0);
+        queue_text(connection, FRAME_NOTICE, response);
     }
 }
 
-// Handle requests from the client
-void handle_client_messages(std::string username)
+// Check the password and, if it matches, bring the user online
+void login_client(Connection *connection, const std::string &password)
 {
-    int acceptSocket = client_socket[username];
-    char buffer[BUFFER_SIZE];
-    while (true)
+    std::string username = connection->username;
+    server_logs("Login attempt for " + username);
+    // The store is read-only, so the hash is checked outside the lock
+    int user = users.find(username);
+    bool accepted = user >= 0 && users.check_password(user, password);
+    const OnlineSnapshot *online = nullptr;
+    if (accepted)
     {
-        memset(buffer, 0, BUFFER_SIZE);
-        {
-            std::lock_guard<std::mutex> lock(client_recv_mutexes[acceptSocket]);
-            int bytes_received = recv(acceptSocket, buffer, BUFFER_SIZE, 0);
-            if (bytes_received <= 0)
-            {
-                server_logs("Disconnected from client " + username);
-                client_send_mutexes.erase(acceptSocket);
-                client_recv_mutexes.erase(acceptSocket);
-                close(acceptSocket);
-                {
-                    std::lock_guard<std::mutex> lock(global_mutex);
-                    logged_in[username] = 0;
-                }
-
-                std::lock_guard<std::mutex> lock(global_mutex);
-                client_socket.erase(username);
-                return;
-            }
-        }
-        handle_messages(username, buffer);
+        std::lock_guard<std::mutex> lock(global_mutex);
+        accepted = online_position[user] < 0;
+        if (accepted)
+            online = set_online(user);
+    }
+    if (!accepted)
+    {
+        server_logs("Authentication failed for " + username);
+        queue_text(connection, FRAME_NOTICE, "Authentication failed");
+        if (flush_output(connection))
+            close_connection(connection);
+        return;
     }
-}
 
-// Handle the joining of a client
-void handle_client(std::string username)
-{
-    int acceptSocket = client_socket[username];
+    server_logs("Authentication successful for " + username);
+    queue_text(connection, FRAME_NOTICE, "Welcome to the server " + username + "!");
+    server_logs("Welcome " + username + "!");
+    connection->state = STATE_ONLINE;
+    connection->user = user;
 
-    // send messages about other participants
+    // send messages about other participants, from the snapshot that
+    // includes this login
+    for (int client : online->users)
     {
-        std::lock_guard<std::mutex> lock(global_mutex);
-        for (auto [client, logged_in] : logged_in)
+        if (client != user)
         {
-            if (logged_in == 1 && client != username)
-            {
-                // take the lock
-                std::string message = client + " has joined the chat";
-                std::string message_to_send = "\n" + message;
-                int id = client_socket[username];
-                server_logs("Sending message to " + username + ": " + message);
-                std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-                send(acceptSocket, message_to_send.c_str(), message_to_send.size(), 0);
-            }
+            std::string message = users.name(client) + " has joined the chat";
+            // Frames arrive one per line anyway; legacy text needs the break
+            std::string message_to_send = connection->framed ? message : "\n" + message;
+            server_logs("Sending message to " + username + ": " + message);
+            queue_text(connection, FRAME_NOTICE, message_to_send);
         }
     }
 
-    // create a thread to handle messages from this client
-    std::thread handle_client_messages_thread(handle_client_messages, username);
-    handle_client_messages_thread.detach();
+    // Deliver whatever arrived while the user was offline: the log on disk
+    // first, then anything still in the mailbox
+    Mailbox &mailbox = mailboxes[user];
+    connection->mailbox = &mailbox;
+    {
+        std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+        if (offline_limit > 0 && !mailbox.offline.loaded)
+            mailbox.offline.load(offline_dir + "/" + username);
+        connection->replaying = !mailbox.offline.empty();
+        mailbox.connection = connection;
+        mailbox.reactor.store(connection->reactor);
+    }
+    if (connection->replaying)
+        server_logs("Replaying " + std::to_string(mailbox.offline.stored_bytes) + " bytes of offline messages to " + username);
+    if (connection->replaying || mailbox.size.load() > 0)
+        schedule_mailbox(mailbox);
 }
 
-// Authenticate the client
-void authenticate_client(int acceptSocket)
+// One piece of client input, in whatever state the connection is in
+void handle_input(Connection *connection, const std::string &text)
 {
-    char user_prompt[BUFFER_SIZE];
-    char password_prompt[BUFFER_SIZE];
-    char username[BUFFER_SIZE];
-    char password[BUFFER_SIZE];
-    int id = acceptSocket;
-    memset(username, 0, BUFFER_SIZE);
-    memset(password, 0, BUFFER_SIZE);
-    strcpy(user_prompt, "Enter username: ");
-    strcpy(password_prompt, "Enter password: ");
+    if (connection->state == STATE_USERNAME)
+    {
+        connection->username = text;
+        queue_text(connection, FRAME_NOTICE, "Enter password: ");
+        connection->state = STATE_PASSWORD;
+    }
+    else if (connection->state == STATE_PASSWORD)
+        login_client(connection, text);
+    else if (connection->state == STATE_ONLINE)
+        handle_messages(connection, text);
+}
 
+// The socket is readable. A legacy client's input is one recv() per
+// command; a framed client's is everything that has arrived, cut into
+// frames. A first reply starting with a zero byte is a hello frame and
+// switches the connection to frames.
+void read_client(Connection *connection)
+{
+    char buffer[FRAME_READ_SIZE];
+    if (!connection->framed)
     {
-        std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-        int bytes_sent = send(acceptSocket, user_prompt, strlen(user_prompt), 0);
-        if (bytes_sent < 0)
+        int bytes_received = recv(connection->socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (bytes_received <= 0)
+        {
+            close_connection(connection);
+            return;
+        }
+        if (connection->state != STATE_USERNAME || buffer[0] != 0)
         {
-            perror("send() failed (username prompt)");
-            client_send_mutexes.erase(acceptSocket);
-            client_recv_mutexes.erase(acceptSocket);
-            close(acceptSocket);
+            handle_input(connection, std::string(buffer, strnlen(buffer, bytes_received)));
+            if (!connection->closed)
+                flush_output(connection);
             return;
         }
+        connection->framed = true;
+        connection->state = STATE_HELLO;
+        connection->decoder.feed(buffer, bytes_received);
     }
-
+    else
     {
-        std::lock_guard<std::mutex> lock(client_recv_mutexes[id]);
-        memset(username, 0, BUFFER_SIZE);
-        int bytes_received = recv(acceptSocket, username, BUFFER_SIZE, 0);
-        if (bytes_received <= 0)
+        // Bounded so one busy client cannot hold up the rest of the reactor
+        for (int reads = 0; reads < READS_PER_EVENT; reads++)
         {
-            server_logs("Disconnected from client at socket " + std::to_string(acceptSocket) + " (username)");
-            client_send_mutexes.erase(acceptSocket);
-            client_recv_mutexes.erase(acceptSocket);
-            close(acceptSocket);
-            return;
+            int bytes_received = recv(connection->socket, buffer, FRAME_READ_SIZE, 0);
+            if (bytes_received < 0 && errno == EINTR)
+                continue;
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (bytes_received <= 0)
+            {
+                close_connection(connection);
+                return;
+            }
+            connection->decoder.feed(buffer, bytes_received);
+            if (bytes_received < FRAME_READ_SIZE)
+                break;
         }
     }
 
+    Frame frame;
+    DecodeResult result;
+    while (!connection->closed && (result = connection->decoder.next(frame)) == DECODE_FRAME)
     {
-        std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-        int bytes_sent = send(acceptSocket, password_prompt, strlen(password_prompt), 0);
-        if (bytes_sent < 0)
+        if (connection->state == STATE_HELLO)
         {
-            perror("send() failed (password prompt)");
-            client_send_mutexes.erase(acceptSocket);
-            client_recv_mutexes.erase(acceptSocket);
-            close(acceptSocket);
-            return;
+            if (frame.type != FRAME_HELLO || frame.payload != PROTOCOL_VERSION)
+            {
+                close_connection(connection);
+                return;
+            }
+            connection->state = STATE_USERNAME;
         }
+        else if (frame.type == FRAME_TEXT)
+            handle_input(connection, frame.payload);
+    }
+    if (connection->closed)
+        return;
+    if (result == DECODE_ERROR)
+    {
+        close_connection(connection);
+        return;
     }
+    flush_output(connection);
+}
 
+// Queue the next stretch of the offline log, straight from the mapped
+// segment. Frames go out as they are; legacy clients get each payload.
+void replay_offline(Connection *connection)
+{
+    Mailbox &mailbox = *connection->mailbox;
+    ReplayBatch batch;
     {
-        std::lock_guard<std::mutex> lock(client_recv_mutexes[id]);
-        memset(password, 0, BUFFER_SIZE);
-        int bytes_received = recv(acceptSocket, password, BUFFER_SIZE, 0);
-        if (bytes_received <= 0)
+        std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+        if (!mailbox.offline.replay(batch))
         {
-            server_logs("Disconnected from client at socket " + std::to_string(acceptSocket) + " (password)");
-            client_send_mutexes.erase(acceptSocket);
-            client_recv_mutexes.erase(acceptSocket);
-            close(acceptSocket);
+            connection->replaying = false;
             return;
         }
     }
+    // The log commits the batch only once the socket has taken all of it
+    connection->replay_unsent = batch.length;
+    if (connection->framed)
+    {
+        connection->output.push_back({batch.mapping, batch.data, batch.length, true});
+        connection->output_bytes += batch.length;
+        flush_output(connection);
+        return;
+    }
+    for (size_t offset = 0; offset < batch.length && !connection->closed;)
+    {
+        size_t frame = whole_frame_length(batch.data + offset, batch.length - offset);
+        connection->output.push_back({batch.mapping, batch.data + offset + FRAME_HEADER_SIZE, frame - FRAME_HEADER_SIZE, true});
+        connection->output_bytes += frame - FRAME_HEADER_SIZE;
+        offset += frame;
+        // Legacy clients are not sent the header
+        replay_sent(connection, FRAME_HEADER_SIZE);
+        flush_output(connection);
+    }
+}
 
-    server_logs("Username: " + std::string(username) + " Password: " + std::string(password));
-    if (Passwords.find(username) == Passwords.end() || Passwords[username] != password || logged_in[username] == 1)
+// The client is not reading and its mailbox is over queue_limit: apply
+// slow_policy. Only this client is affected; the reactor never waits on it.
+void shed_backlog(Connection *connection, Mailbox &mailbox)
+{
+    if (slow_policy == SLOW_DISCONNECT)
     {
-        server_logs("Authentication failed for " + std::string(username));
-        std::string response = "Authentication failed";
-        id = acceptSocket;
-        std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-        send(acceptSocket, response.c_str(), response.size(), 0);
-        client_send_mutexes.erase(acceptSocket);
-        client_recv_mutexes.erase(acceptSocket);
-        close(acceptSocket);
+        server_logs("Disconnecting " + connection->username + ": " + std::to_string(mailbox.bytes.load()) + " bytes waiting and not reading");
+        close_connection(connection);
         return;
     }
-    else
+    int64_t spilled = 0, dropped = 0;
+    while (mailbox.bytes.load() > queue_limit)
     {
-        // take the lock
-        server_logs("Authentication successful for " + std::string(username));
+        Message *message = mailbox.pop();
+        if (message == nullptr)
+            break;
+        mailbox.size.fetch_sub(1, std::memory_order_relaxed);
+        mailbox.bytes.fetch_sub(message->frame->size(), std::memory_order_relaxed);
+        bool stored = false;
+        if (slow_policy == SLOW_SPILL && offline_limit > 0)
         {
-            std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-            std::string response = "Welcome to the server " + std::string(username) + "!";
-            send(acceptSocket, response.c_str(), response.size(), 0);
+            // Older than everything left in the mailbox, and the log is
+            // replayed first, so the order holds
+            std::lock_guard<std::mutex> lock(mailbox.store_mutex);
+            stored = store_offline(mailbox, *message->frame);
         }
-        server_logs("Welcome " + std::string(username) + "!");
+        (stored ? spilled : dropped) += message->frame->size();
+        delete message;
+    }
+    if (spilled > 0)
+    {
+        connection->replaying = true;
+        server_logs("Spilled " + std::to_string(spilled) + " bytes for slow client " + connection->username + " to disk");
+    }
+    if (dropped > 0)
+        server_logs("Dropped " + std::to_string(dropped) + " bytes of old messages for slow client " + connection->username);
+}
+
+// Queue the mailbox's messages to its owner, at most a batch at a time so
+// one busy mailbox cannot starve the others. Legacy clients get one send()
+// per message while the socket keeps up; frames go out as one batch. The
+// offline log, if any, goes first.
+void deliver_mailbox(Reactor &reactor, Mailbox &mailbox)
+{
+    // The owner may have logged out, or back in on another reactor, since
+    // the mailbox was queued here
+    Connection *connection = mailbox.reactor.load() == reactor.index ? mailbox.connection : nullptr;
+    if (connection != nullptr && connection->replaying)
+    {
+        // One batch at a time, so that it can be committed when sent
+        if (connection->replay_unsent == 0 && pending_output(connection) < OUTPUT_LIMIT)
+            replay_offline(connection);
+    }
+    else if (connection != nullptr && pending_output(connection) < OUTPUT_LIMIT)
+    {
+        for (int delivered = 0; !connection->closed && delivered < DELIVERY_BATCH; delivered++)
         {
-            std::lock_guard<std::mutex> lock(global_mutex);
-            logged_in[username] = 1;
+            Message *message = mailbox.pop();
+            if (message == nullptr)
+                break;
+            mailbox.size.fetch_sub(1, std::memory_order_relaxed);
+            mailbox.bytes.fetch_sub(message->frame->size(), std::memory_order_relaxed);
+
+            // Not logged: the text was logged once when it was posted, and a
+            // line per recipient would take cout_mutex on every delivery
+            // The frame's payload is exactly what a legacy client expects
+            queue_buffer(connection, message->frame, connection->framed ? 0 : FRAME_HEADER_SIZE);
+            connection->in_flight.push_back({message->frame, connection->sent_bytes + connection->output_bytes});
+            delete message;
+            if (!connection->framed)
+                flush_output(connection);
         }
+        if (!connection->closed)
+            flush_output(connection);
+    }
+    if (connection != nullptr && !connection->closed && pending_output(connection) >= OUTPUT_LIMIT && mailbox.bytes.load() > queue_limit)
+        shed_backlog(connection, mailbox);
 
-        // if authentication is successful, start the client thread
-        client_socket[username] = acceptSocket;
-        handle_client(username);
+    // A producer that pushed while we were still scheduled did not schedule
+    // the mailbox, so look again after letting go of it. While the client is
+    // behind, flush_output() does that once the socket drains.
+    mailbox.scheduled.store(false);
+    bool blocked = connection != nullptr && !connection->closed && (pending_output(connection) >= OUTPUT_LIMIT || connection->replay_unsent > 0);
+    bool replaying = connection != nullptr && !connection->closed && connection->replaying;
+    if (!blocked && (replaying || mailbox.size.load() > 0) && mailbox.reactor.load() >= 0)
+        schedule_mailbox(mailbox);
+}
+
+// Register an accepted socket and greet it. The first prompt is always
+// plain text: the client has not said yet whether it wants frames.
+void add_connection(Reactor &reactor, int socket)
+{
+    Connection *connection = new Connection;
+    connection->socket = socket;
+    connection->reactor = reactor.index;
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, socket, &event) < 0)
+    {
+        perror("epoll_ctl() failed");
+        close(socket);
+        delete connection;
+        return;
     }
+    queue_text(connection, FRAME_NOTICE, "Enter username: ");
+    flush_output(connection);
 }
 
-// Handle message pushing to each client
-void push_messages()
+void run_reactor(Reactor &reactor, bool pin)
 {
+    if (pin)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(reactor.index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    std::vector<int> new_sockets;
+    std::vector<Mailbox *> ready_mailboxes;
     while (true)
     {
-        std::lock_guard<std::mutex> lock(global_mutex);
-        std::queue<std::tuple<std::string, std::string, std::string>> afk_queue;
-        while (!msgs.empty())
+        // Nothing read from an online snapshot survives to here, so while
+        // waiting this reactor holds none, and afterwards only newer ones
+        reactor.seen_epoch.store(RCU_IDLE);
+        int count = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, -1);
+        reactor.seen_epoch.store(rcu_epoch.load());
+        if (count < 0)
         {
-            auto [sender, receiver, message] = msgs.front();
-            msgs.pop();
-            std::string msg = "[" + sender + "]: " + message;
-
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait() failed");
+            exit(1);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            Connection *connection = (Connection *)events[i].data.ptr;
+            if (connection == nullptr)
             {
-                if (logged_in[receiver] == 1)
-                {
-                    int id = client_socket[receiver];
-                    // take the lock
-                    server_logs("Sending message from " + sender + " to " + receiver + ": " + message);
-                    std::lock_guard<std::mutex> lock(client_send_mutexes[id]);
-                    send(client_socket[receiver], msg.c_str(), msg.size(), 0);
-                }
-                else
+                uint64_t value;
+                if (read(reactor.wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+                    perror("read() failed (eventfd)");
                 {
-                    // push to the back of the queue
-                    afk_queue.push({sender, receiver, message});
+                    std::lock_guard<std::mutex> lock(reactor.inbox_mutex);
+                    new_sockets.swap(reactor.new_sockets);
+                    ready_mailboxes.swap(reactor.ready_mailboxes);
+                    reactor.wake_pending = false;
                 }
+                for (int socket : new_sockets)
+                    add_connection(reactor, socket);
+                for (Mailbox *mailbox : ready_mailboxes)
+                    deliver_mailbox(reactor, *mailbox);
+                new_sockets.clear();
+                ready_mailboxes.clear();
+                continue;
+            }
+            if (connection->closed)
+                continue;
+            // A bad request costs its own connection, not the reactor's others
+            try
+            {
+                if (events[i].events & EPOLLOUT)
+                    flush_output(connection);
+                if (!connection->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    read_client(connection);
+            }
+            catch (const std::exception &error)
+            {
+                server_logs("Closing client " + connection->username + " after an error: " + error.what());
+                if (!connection->closed)
+                    close_connection(connection);
             }
         }
-        while (!afk_queue.empty())
-        {
-            msgs.push(afk_queue.front());
-            afk_queue.pop();
-        }
+
+        // Later events in the batch may still have pointed at these
+        for (Connection *connection : reactor.closed)
+            delete connection;
+        reactor.closed.clear();
     }
 }
 
-int main()
+int main(int argc, char *argv[])
 {
     int port = 12345;
-
-    // read from users.txt
-    std::ifstream usersFile("users.txt");
-    if (!usersFile.is_open())
+    int reactor_count = std::max(1u, std::thread::hardware_concurrency());
+    fanout_workers = std::thread::hardware_concurrency() > 1 ? std::thread::hardware_concurrency() - 1 : 0;
+    bool pin = true;
+    std::string users_path = "users.txt";
+    std::string user_snapshot;
+    for (int i = 1; i < argc; i++)
     {
-        std::cerr << "Failed to open users.txt" << std::endl;
-        return 0;
+        std::string arg = argv[i];
+        if (arg == "--reactors" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            reactor_count = atoi(argv[++i]);
+        else if (arg == "--fanout-workers" && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+            fanout_workers = atoi(argv[++i]);
+        else if (arg == "--offline-dir" && i + 1 < argc)
+            offline_dir = argv[++i];
+        else if (arg == "--offline-limit" && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+            offline_limit = (uint64_t)atoi(argv[++i]) * 1024 * 1024;
+        else if (arg == "--users" && i + 1 < argc)
+            users_path = argv[++i];
+        else if (arg == "--user-snapshot" && i + 1 < argc)
+            user_snapshot = argv[++i];
+        else if (arg == "--slow-consumer" && i + 1 < argc && (std::string(argv[i + 1]) == "spill" || std::string(argv[i + 1]) == "drop-oldest" || std::string(argv[i + 1]) == "disconnect"))
+        {
+            std::string policy = argv[++i];
+            slow_policy = policy == "spill" ? SLOW_SPILL : policy == "drop-oldest" ? SLOW_DROP_OLDEST : SLOW_DISCONNECT;
+        }
+        else if (arg == "--queue-limit" && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+            queue_limit = (int64_t)atoi(argv[++i]) * 1024 * 1024;
+        else if (arg == "--no-pin")
+            pin = false;
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--reactors <n>] [--fanout-workers <n>]\n"
+                      << "       [--offline-dir <path>] [--offline-limit <MB per user>]\n"
+                      << "       [--users <path>] [--user-snapshot <path>]\n"
+                      << "       [--slow-consumer spill|drop-oldest|disconnect] [--queue-limit <MB>] [--no-pin]" << std::endl;
+            return 1;
+        }
     }
 
-    std::string str;
-    while (usersFile >> str)
+    // Load users.txt, or the snapshot of it if that is still current
+    std::string error;
+    if (!user_snapshot.empty() && users.map_snapshot(user_snapshot, users_path))
+        server_logs("Loaded " + std::to_string(users.size()) + " users from " + user_snapshot);
+    else
     {
-        // username:password
-        auto pos = str.find(':');
-        if (pos == std::string::npos)
+        if (!users.build(users_path, error))
         {
-            std::cerr << "Invalid line in users.txt: " << str << std::endl;
+            std::cerr << error << std::endl;
             return 0;
         }
-        std::string username = str.substr(0, pos);
-        std::string password = str.substr(pos + 1);
-        Passwords[username] = password;
+        server_logs("Loaded " + std::to_string(users.size()) + " users from " + users_path);
+        if (!user_snapshot.empty() && !users.write_snapshot(user_snapshot))
+            perror(("Cannot write " + user_snapshot).c_str());
+    }
+    mailboxes = std::vector<Mailbox>(users.size());
+    for (int user = 0; user < users.size(); user++)
+        mailboxes[user].user = user;
+    online_position.assign(users.size(), -1);
+    online_snapshot.store(new OnlineSnapshot{0, {}});
+
+    if (offline_limit > 0 && mkdir(offline_dir.c_str(), 0700) < 0 && errno != EEXIST)
+    {
+        perror(("Cannot create " + offline_dir).c_str());
+        return 1;
+    }
+
+    // Clients and the offline logs' open segments share the descriptor limit;
+    // keep most of it for clients
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if (limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+        offline_open_limit = (int)std::min<rlim_t>(limit.rlim_cur / 4, 65536);
     }
 
     // Create the server socket
@@ -476,29 +1367,59 @@ int main()
         close(serverSocket);
         return 0;
     }
-    std::cout << "Server started on port " << port << "\n";
+    std::cout << "Server started on port " << port << " with " << reactor_count << " reactors\n";
 
-    std::thread push_dms_thread(push_messages);
-    push_dms_thread.detach();
+    for (int i = 0; i < reactor_count; i++)
+    {
+        Reactor &reactor = reactors.emplace_back();
+        reactor.index = i;
+        reactor.epoll_fd = epoll_create1(0);
+        reactor.wake_fd = eventfd(0, EFD_NONBLOCK);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if (reactor.epoll_fd < 0 || reactor.wake_fd < 0 || epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.wake_fd, &event) < 0)
+        {
+            perror("Failed to create reactor");
+            return 1;
+        }
+    }
+    for (Reactor &reactor : reactors)
+    {
+        std::thread reactor_thread(run_reactor, std::ref(reactor), pin);
+        reactor_thread.detach();
+    }
+    for (int i = 0; i < fanout_workers; i++)
+    {
+        std::thread fanout_thread(fanout_worker);
+        fanout_thread.detach();
+    }
 
+    // This thread only accepts; connections are dealt out round-robin
+    int next_reactor = 0;
     while (1)
     {
         server_logs("Waiting for client connection...");
         sockaddr clientaddress;
         __socklen_t addressLength = sizeof(clientaddress);
-        int acceptSocket = accept(serverSocket, (sockaddr *)&clientaddress, &addressLength);
+        int acceptSocket = accept4(serverSocket, (sockaddr *)&clientaddress, &addressLength, SOCK_NONBLOCK);
         if (acceptSocket == INVALID_SOCKET)
         {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
             close(serverSocket);
             exit(0);
         }
+        // Replies and batches are already whole; do not hold them back waiting for ACKs
+        int nodelay = 1;
+        setsockopt(acceptSocket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << "Connected to : " << inet_ntoa(((sockaddr_in *)&clientaddress)->sin_addr) << " " << "on socket" << " " << acceptSocket << "\n";
-        client_send_mutexes[acceptSocket];
-        client_recv_mutexes[acceptSocket];
-        std::thread authenticate_client_thread(authenticate_client, acceptSocket);
-        authenticate_client_thread.detach();
+        {
+            std::lock_guard<std::mutex> lock(cout_mutex);
+            std::cout << "Connected to : " << inet_ntoa(((sockaddr_in *)&clientaddress)->sin_addr) << " " << "on socket" << " " << acceptSocket << "\n";
+        }
+        wake_reactor(reactors[next_reactor], acceptSocket, nullptr);
+        next_reactor = (next_reactor + 1) % reactor_count;
     }
     return 0;
 }
@@ -0,0 +1,411 @@
+// Credential store built from users.txt.
+//
+// users.txt is mapped and scanned in place, and the result is one flat image:
+//
+//     +--------+------------------------+--------------------------+-------+
+//     | header | slots (open addressing) | records (one per user)  | names |
+//     +--------+------------------------+--------------------------+-------+
+//
+// A slot holds the high half of the name's hash and the user's index + 1
+// (0 marks an empty slot); collisions probe linearly. A record holds where
+// the name is in the names area and a salted SHA-256 of the password, so
+// plaintext passwords never stay in memory or in the snapshot.
+//
+// The image has no pointers, so it can be written to a snapshot file as is
+// and mapped on the next start. The snapshot remembers the size and mtime of
+// the users.txt it was built from and is rebuilt when either changes. Once
+// built, the store is only read, so any number of threads may use it.
+
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include "sha256.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#define USER_STORE_MAGIC "CHATUSR1"
+#define USER_SALT_SIZE 16
+
+struct UserStoreHeader
+{
+    char magic[8];
+    uint64_t source_size;     // of the users.txt the image was built from
+    int64_t source_mtime;     // nanoseconds
+    uint32_t user_count;
+    uint32_t slot_count;      // a power of two, at least twice user_count
+    uint64_t names_size;
+};
+
+struct UserSlot
+{
+    uint32_t tag;             // high 32 bits of the name's hash
+    uint32_t user;            // index + 1; 0 when empty
+};
+
+struct UserRecord
+{
+    uint32_t name_offset;
+    uint32_t name_length;
+    uint8_t salt[USER_SALT_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];   // SHA-256(salt + password)
+};
+
+// FNV-1a
+inline uint64_t hash_name(const char *name, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+inline void hash_password(const uint8_t salt[USER_SALT_SIZE], const char *password, size_t length, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    Sha256 sha;
+    sha.update(salt, USER_SALT_SIZE);
+    sha.update(password, length);
+    sha.finish(digest);
+}
+
+struct UserStore
+{
+    UserStore() = default;
+    UserStore(const UserStore &) = delete;
+    UserStore &operator=(const UserStore &) = delete;
+
+    ~UserStore()
+    {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_length);
+    }
+
+    int size() const
+    {
+        return header == nullptr ? 0 : header->user_count;
+    }
+
+    std::string name(int user) const
+    {
+        const UserRecord &record = records[user];
+        if ((uint64_t)record.name_offset + record.name_length > header->names_size)
+            return std::string();
+        return std::string(names + record.name_offset, record.name_length);
+    }
+
+    // Index of `name`, or -1 if there is no such user
+    int find(const char *name, size_t length) const
+    {
+        if (header == nullptr || header->slot_count == 0)
+            return -1;
+        uint64_t hash = hash_name(name, length);
+        uint32_t tag = hash >> 32;
+        uint32_t mask = header->slot_count - 1;
+        uint32_t position = hash & mask;
+        // A valid table always has empty slots; the bound is for one that is not
+        for (uint32_t probes = 0; probes < header->slot_count; probes++, position = (position + 1) & mask)
+        {
+            const UserSlot &slot = slots[position];
+            if (slot.user == 0)
+                return -1;
+            if (slot.tag != tag || slot.user > header->user_count)
+                continue;
+            const UserRecord &record = records[slot.user - 1];
+            // Checked here rather than when mapping, which would read every record
+            if (record.name_length == length && (uint64_t)record.name_offset + length <= header->names_size && memcmp(names + record.name_offset, name, length) == 0)
+                return slot.user - 1;
+        }
+        return -1;
+    }
+
+    int find(const std::string &name) const
+    {
+        return find(name.data(), name.size());
+    }
+
+    bool check_password(int user, const std::string &password) const
+    {
+        const UserRecord &record = records[user];
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        hash_password(record.salt, password.data(), password.size(), digest);
+        // Compare every byte, so the time taken says nothing about the hash
+        uint8_t difference = 0;
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+            difference |= digest[i] ^ record.digest[i];
+        return difference == 0;
+    }
+
+    // Parse `users_path`: whitespace-separated "username:password" entries.
+    // A later entry for the same name replaces the earlier one.
+    bool build(const std::string &users_path, std::string &error)
+    {
+        int fd = open(users_path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) < 0)
+        {
+            if (fd >= 0)
+                close(fd);
+            error = "Failed to open " + users_path;
+            return false;
+        }
+        size_t file_size = info.st_size;
+        const char *text = "";
+        void *file = nullptr;
+        if (file_size > 0)
+        {
+            file = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (file == MAP_FAILED)
+            {
+                close(fd);
+                error = "Failed to map " + users_path;
+                return false;
+            }
+            madvise(file, file_size, MADV_SEQUENTIAL);
+            text = (const char *)file;
+        }
+        close(fd);
+        if (file_size > UINT32_MAX)
+        {
+            munmap(file, file_size);
+            error = users_path + " is too large";
+            return false;
+        }
+
+        // First pass: find every entry and size the image
+        struct Entry
+        {
+            uint32_t name, name_length, password, password_length;
+        };
+        std::vector<Entry> entries;
+        entries.reserve(file_size / 16);
+        bool valid = true;
+        for (size_t i = 0; i < file_size;)
+        {
+            while (i < file_size && is_space(text[i]))
+                i++;
+            size_t start = i;
+            while (i < file_size && !is_space(text[i]))
+                i++;
+            if (start == i)
+                break;
+            const char *colon = (const char *)memchr(text + start, ':', i - start);
+            if (colon == nullptr)
+            {
+                error = "Invalid line in " + users_path + ": " + std::string(text + start, i - start);
+                valid = false;
+                break;
+            }
+            uint32_t colon_at = colon - text;
+            entries.push_back({(uint32_t)start, colon_at - (uint32_t)start, colon_at + 1, (uint32_t)(i - colon_at - 1)});
+        }
+        if (!valid)
+        {
+            if (file != nullptr)
+                munmap(file, file_size);
+            return false;
+        }
+
+        uint32_t slot_count = 16;
+        while (slot_count < entries.size() * 2)
+            slot_count *= 2;
+        uint64_t names_size = 0;
+        for (const Entry &entry : entries)
+            names_size += entry.name_length;
+        if (mapping != nullptr)
+        {
+            munmap(mapping, mapping_length);
+            mapping = nullptr;
+        }
+        owned.assign(sizeof(UserStoreHeader) + (size_t)slot_count * sizeof(UserSlot) + entries.size() * sizeof(UserRecord) + names_size, 0);
+        header = (UserStoreHeader *)owned.data();
+        memcpy(header->magic, USER_STORE_MAGIC, sizeof(header->magic));
+        header->source_size = file_size;
+        header->source_mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        header->slot_count = slot_count;
+        attach(owned.data());
+        // Room for a record per entry until duplicates are known
+        names = (const char *)(records + entries.size());
+
+        std::vector<uint8_t> salts(entries.size() * USER_SALT_SIZE);
+        if (!random_bytes(salts.data(), salts.size()))
+        {
+            error = "getrandom() failed";
+            if (file != nullptr)
+                munmap(file, file_size);
+            owned.clear();
+            header = nullptr;
+            return false;
+        }
+
+        // Second pass: insert, copying names into the image
+        uint32_t user_count = 0;
+        uint64_t names_used = 0;
+        char *names_out = (char *)names;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const Entry &entry = entries[i];
+            uint64_t hash = hash_name(text + entry.name, entry.name_length);
+            int user = find(text + entry.name, entry.name_length);
+            if (user < 0)
+            {
+                user = user_count++;
+                header->user_count = user_count;
+                UserRecord &record = records[user];
+                record.name_offset = names_used;
+                record.name_length = entry.name_length;
+                memcpy(names_out + names_used, text + entry.name, entry.name_length);
+                names_used += entry.name_length;
+                uint32_t mask = slot_count - 1;
+                uint32_t position = hash & mask;
+                while (slots[position].user != 0)
+                    position = (position + 1) & mask;
+                slots[position].tag = hash >> 32;
+                slots[position].user = user + 1;
+            }
+            UserRecord &record = records[user];
+            memcpy(record.salt, &salts[i * USER_SALT_SIZE], USER_SALT_SIZE);
+            hash_password(record.salt, text + entry.password, entry.password_length, record.digest);
+        }
+        header->names_size = names_used;
+        if (file != nullptr)
+            munmap(file, file_size);
+
+        // Duplicates leave some records unused; drop them with the names
+        // moved up behind the records that are used
+        char *records_end = (char *)(records + user_count);
+        memmove(records_end, names, names_used);
+        owned.resize(records_end - owned.data() + names_used);
+        attach(owned.data());
+        return true;
+    }
+
+    // Write the image where the next start can map it
+    bool write_snapshot(const std::string &path) const
+    {
+        std::string temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0)
+            return false;
+        size_t length = image_length();
+        size_t written = 0;
+        while (written < length)
+        {
+            ssize_t bytes = write(fd, (const char *)header + written, length - written);
+            if (bytes <= 0)
+                break;
+            written += bytes;
+        }
+        bool complete = written == length && fsync(fd) == 0;
+        close(fd);
+        if (!complete || rename(temporary.c_str(), path.c_str()) < 0)
+        {
+            unlink(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Map a snapshot written by write_snapshot(). It is refused if it is
+    // damaged, or if `users_path` exists and has changed since; a snapshot
+    // is used on its own when `users_path` is gone.
+    bool map_snapshot(const std::string &path, const std::string &users_path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(UserStoreHeader))
+        {
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        void *address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED)
+            return false;
+
+        const UserStoreHeader *image = (const UserStoreHeader *)address;
+        uint64_t expected = sizeof(UserStoreHeader) + (uint64_t)image->slot_count * sizeof(UserSlot) + (uint64_t)image->user_count * sizeof(UserRecord) + image->names_size;
+        bool valid = memcmp(image->magic, USER_STORE_MAGIC, sizeof(image->magic)) == 0 && image->slot_count >= 16 && (image->slot_count & (image->slot_count - 1)) == 0 && image->user_count <= image->slot_count / 2 && expected == (uint64_t)info.st_size;
+        struct stat source;
+        if (valid && stat(users_path.c_str(), &source) == 0)
+            valid = (uint64_t)source.st_size == image->source_size && (int64_t)source.st_mtim.tv_sec * 1000000000 + source.st_mtim.tv_nsec == image->source_mtime;
+        if (valid)
+        {
+            // Every user in exactly one slot, so at least half the slots are
+            // empty and every probe ends. Names are checked in find().
+            const UserSlot *image_slots = (const UserSlot *)(image + 1);
+            uint64_t used = 0;
+            for (uint32_t i = 0; i < image->slot_count && valid; i++)
+            {
+                used += image_slots[i].user != 0;
+                valid = image_slots[i].user <= image->user_count;
+            }
+            valid = valid && used == image->user_count;
+        }
+        if (!valid)
+        {
+            munmap(address, info.st_size);
+            return false;
+        }
+        if (mapping != nullptr)
+            munmap(mapping, mapping_length);
+        owned.clear();
+        owned.shrink_to_fit();
+        mapping = address;
+        mapping_length = info.st_size;
+        attach((char *)address);
+        return true;
+    }
+
+private:
+    std::vector<char> owned;          // the image when built here
+    void *mapping = nullptr;          // the image when mapped from a snapshot
+    size_t mapping_length = 0;
+    UserStoreHeader *header = nullptr;
+    UserSlot *slots = nullptr;
+    UserRecord *records = nullptr;
+    const char *names = nullptr;
+
+    static bool is_space(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    static bool random_bytes(uint8_t *out, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t bytes = getrandom(out, length, 0);
+            if (bytes <= 0)
+                return false;
+            out += bytes;
+            length -= bytes;
+        }
+        return true;
+    }
+
+    void attach(char *image)
+    {
+        header = (UserStoreHeader *)image;
+        slots = (UserSlot *)(image + sizeof(UserStoreHeader));
+        records = (UserRecord *)(slots + header->slot_count);
+        names = (const char *)(records + header->user_count);
+    }
+
+    size_t image_length() const
+    {
+        return sizeof(UserStoreHeader) + (size_t)header->slot_count * sizeof(UserSlot) + (size_t)header->user_count * sizeof(UserRecord) + header->names_size;
+    }
+};
+
+#endif
@@ -0,0 +1,191 @@
+// Benchmark for loading users.txt.
+// Writes a users file with --users entries ("uN:pN", like users.txt), then
+// times the old loader (ifstream >> str into a std::map) against UserStore:
+// building it from the file, writing a snapshot, and mapping that snapshot
+// with the page cache dropped for it. After each load it looks up every user
+// in a random order, both the name alone and the full password check.
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include "user_store.h"
+
+int user_count = 1000000;
+std::string users_path = "bench_users.txt";
+std::string snapshot_path = "bench_users.snapshot";
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Current resident memory, in kB
+long rss_kb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return atol(line.c_str() + 6);
+    return 0;
+}
+
+// Evict `path` from the page cache, so the next read comes from disk
+void drop_cache(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+void report(const char *what, uint64_t ns, long rss_before)
+{
+    printf("%-28s %9.1f ms   +%ld MB RSS\n", what, ns / 1e6, (rss_kb() - rss_before) / 1024);
+}
+
+void report_lookups(const char *what, uint64_t ns, int count, int found)
+{
+    printf("%-28s %9.1f ns per lookup (%d / %d found)\n", what, (double)ns / count, found, count);
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--users" && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            user_count = atoi(argv[++i]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--users <n>]" << std::endl;
+            return 1;
+        }
+    }
+
+    {
+        std::ofstream out(users_path);
+        for (int i = 0; i < user_count; i++)
+            out << 'u' << i << ":p" << i << '\n';
+    }
+    std::vector<std::string> names(user_count), passwords(user_count);
+    for (int i = 0; i < user_count; i++)
+    {
+        names[i] = "u" + std::to_string(i);
+        passwords[i] = "p" + std::to_string(i);
+    }
+    std::vector<int> order(user_count);
+    for (int i = 0; i < user_count; i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+    printf("%d users\n\n", user_count);
+
+    // The old loader
+    {
+        drop_cache(users_path);
+        long rss = rss_kb();
+        uint64_t start = now_ns();
+        std::map<std::string, std::string> Passwords;
+        std::ifstream usersFile(users_path);
+        std::string str;
+        while (usersFile >> str)
+        {
+            auto pos = str.find(':');
+            Passwords[str.substr(0, pos)] = str.substr(pos + 1);
+        }
+        report("std::map load", now_ns() - start, rss);
+
+        int found = 0;
+        start = now_ns();
+        for (int i : order)
+        {
+            auto it = Passwords.find(names[i]);
+            found += it != Passwords.end() && it->second == passwords[i];
+        }
+        report_lookups("std::map lookup + compare", now_ns() - start, user_count, found);
+    }
+    printf("\n");
+
+    // UserStore from the file, then written out as a snapshot
+    {
+        drop_cache(users_path);
+        long rss = rss_kb();
+        uint64_t start = now_ns();
+        UserStore store;
+        std::string error;
+        if (!store.build(users_path, error))
+        {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        report("UserStore build", now_ns() - start, rss);
+
+        start = now_ns();
+        if (!store.write_snapshot(snapshot_path))
+        {
+            perror("write_snapshot() failed");
+            return 1;
+        }
+        report("UserStore write snapshot", now_ns() - start, rss);
+
+        int found = 0;
+        start = now_ns();
+        for (int i : order)
+            found += store.find(names[i]) == i;
+        report_lookups("UserStore find", now_ns() - start, user_count, found);
+
+        found = 0;
+        start = now_ns();
+        for (int i : order)
+        {
+            int user = store.find(names[i]);
+            found += user >= 0 && store.check_password(user, passwords[i]);
+        }
+        report_lookups("UserStore find + password", now_ns() - start, user_count, found);
+    }
+    printf("\n");
+
+    // The snapshot, as the next start would see it
+    {
+        drop_cache(snapshot_path);
+        long rss = rss_kb();
+        uint64_t start = now_ns();
+        UserStore store;
+        if (!store.map_snapshot(snapshot_path, users_path))
+        {
+            std::cerr << "map_snapshot() refused " << snapshot_path << std::endl;
+            return 1;
+        }
+        report("UserStore map snapshot", now_ns() - start, rss);
+
+        int found = 0;
+        start = now_ns();
+        for (int i : order)
+            found += store.find(names[i]) == i;
+        report_lookups("mapped find (cold)", now_ns() - start, user_count, found);
+
+        found = 0;
+        start = now_ns();
+        for (int i : order)
+            found += store.find(names[i]) == i;
+        report_lookups("mapped find (warm)", now_ns() - start, user_count, found);
+    }
+
+    unlink(users_path.c_str());
+    unlink(snapshot_path.c_str());
+    return 0;
+}